@@ -1,12 +1,17 @@
 #include "plugin.hpp"
+#include "prng.hpp"
+#include "packed.hpp"
 #include <thread>
 #include <chrono>
-#include <random>
 
 namespace Arena {
 
 static const int SEQ_COUNT = 16;
 static const int SEQ_LENGTH = 128;
+/** Maximum number of points of a sequence, reached by recorded paths */
+static const int SEQ_LENGTH_MAX = 1024;
+/** Tolerance for simplifying recorded paths, relative to the size of the arena */
+static const float SEQ_SIMPLIFY_EPSILON = 0.002f;
 
 enum MODMODE {
 	RADIUS = 0,
@@ -24,7 +29,8 @@ enum SEQMODE {
 	TRIG_RANDOM_8 = 3,
 	TRIG_RANDOM_4 = 4,
 	VOLT = 10,
-	C4 = 11
+	C4 = 11,
+	RECORD = 20
 };
 
 enum SEQINTERPOLATE {
@@ -50,12 +56,89 @@ enum OUTPUTMODE {
 	FOLD_BI = 5
 };
 
+/**
+ * Points of a sequence, allocated for `capacity` points. Sequences are replaced as a whole by
+ * the UI thread, points are only appended or modified in place.
+ */
 struct SeqItem {
-	float x[SEQ_LENGTH];
-	float y[SEQ_LENGTH];
 	int length = 0;
+	int capacity;
+	float* x;
+	float* y;
+
+	SeqItem(int capacity) : capacity(capacity) {
+		x = new float[2 * capacity];
+		y = x + capacity;
+	}
+
+	~SeqItem() {
+		delete[] x;
+	}
 };
 
+/** Movement of a mix port recorded by the engine thread, committed as sequence by the UI thread */
+struct SeqRecorder {
+	enum STATE {
+		IDLE,
+		RECORDING,
+		DONE
+	};
+
+	std::atomic<int> state{IDLE};
+	/** Sequence slot the recording is stored to */
+	int seq;
+	int length;
+	/** Time until the next point is taken */
+	float phase;
+	float x[SEQ_LENGTH_MAX];
+	float y[SEQ_LENGTH_MAX];
+};
+
+/**
+ * Douglas-Peucker simplification of a path: points closer than `epsilon` to the line between
+ * the points kept around them are dropped. Marks the kept points in `keep`, returns their count.
+ */
+static int seqSimplify(const float* x, const float* y, int length, float epsilon, bool* keep) {
+	if (length <= 2) {
+		std::fill(keep, keep + length, true);
+		return length;
+	}
+	std::fill(keep, keep + length, false);
+	keep[0] = keep[length - 1] = true;
+	int count = 2;
+
+	std::vector<std::pair<int, int>> stack;
+	stack.push_back(std::make_pair(0, length - 1));
+	while (!stack.empty()) {
+		int a = stack.back().first;
+		int b = stack.back().second;
+		stack.pop_back();
+
+		float dx = x[b] - x[a];
+		float dy = y[b] - y[a];
+		float norm = std::sqrt(dx * dx + dy * dy);
+		float dMax = 0.f;
+		int iMax = -1;
+		for (int i = a + 1; i < b; i++) {
+			// Distance to the line through a and b, or to a if both points coincide (closed paths)
+			float d = norm > 0.f ?
+				std::fabs(dy * (x[i] - x[a]) - dx * (y[i] - y[a])) / norm :
+				std::hypot(x[i] - x[a], y[i] - y[a]);
+			if (d > dMax) {
+				dMax = d;
+				iMax = i;
+			}
+		}
+		if (iMax >= 0 && dMax > epsilon) {
+			keep[iMax] = true;
+			count++;
+			stack.push_back(std::make_pair(a, iMax));
+			stack.push_back(std::make_pair(iMax, b));
+		}
+	}
+	return count;
+}
+
 
 template < int IN_PORTS, int MIX_PORTS >
 struct ArenaModule : Module {
@@ -124,13 +207,20 @@ struct ArenaModule : Module {
 	int mixportsUsed = MIX_PORTS;
 
 	/** [Stored to JSON] */
-	SeqItem seqData[MIX_PORTS][SEQ_COUNT];
+	std::atomic<SeqItem*> seqData[MIX_PORTS][SEQ_COUNT];
+	/** Replaced sequences, freed when the engine thread cannot use them anymore */
+	std::vector<std::pair<uint32_t, SeqItem*>> seqRetired;
+	/** Number of process() calls, used for freeing replaced sequences */
+	std::atomic<uint32_t> processCount{0};
 	/** [Stored to JSON] */
 	SEQMODE seqMode[MIX_PORTS];
 	/** [Stored to JSON] */
 	SEQINTERPOLATE seqInterpolate[MIX_PORTS];
 	/** [Stored to JSON] */
 	int seqSelected[MIX_PORTS];
+	/** [Stored to JSON] points per second taken by the recorder */
+	float seqRecordRate[MIX_PORTS];
+	SeqRecorder seqRecorder[MIX_PORTS];
 	int seqEdit;
 
 	int seqCopyPort = -1;
@@ -145,6 +235,9 @@ struct ArenaModule : Module {
 	float lastMixXpos[MIX_PORTS];
 	float lastMixYpos[MIX_PORTS];
 
+	/** [Stored to JSON] */
+	Prng prng;
+
 	dsp::SchmittTrigger seqTrigger[MIX_PORTS];
 	dsp::ClockDivider lightDivider;
 
@@ -166,10 +259,25 @@ struct ArenaModule : Module {
 			configParam(MIX_X_PARAM + i, -1.f, 1.f, 0.f, string::f("MIX %i x-pos attenuverter", i + 1), "x");
 			configParam(MIX_Y_PARAM + i, -1.f, 1.f, 0.f, string::f("MIX %i y-pos attenuverter", i + 1), "x");
 		}
+		for (int i = 0; i < MIX_PORTS; i++) {
+			for (int j = 0; j < SEQ_COUNT; j++) {
+				seqData[i][j] = new SeqItem(0);
+			}
+		}
+		prng.setSeed(random::u64());
 		onReset();
 		lightDivider.setDivision(512);
 	}
 
+	~ArenaModule() {
+		for (int i = 0; i < MIX_PORTS; i++) {
+			for (int j = 0; j < SEQ_COUNT; j++) {
+				delete seqData[i][j].load();
+			}
+		}
+		seqCollect(true);
+	}
+
 	void onReset() override {
 		selectionReset();
 		init();
@@ -184,6 +292,7 @@ struct ArenaModule : Module {
 			seqSelected[i] = 0;
 			seqMode[i] = SEQMODE::TRIG_FWD;
 			seqInterpolate[i] = SEQINTERPOLATE::LINEAR;
+			seqRecordRate[i] = 25.f;
 		}
 		seqCopyPort = -1;
 		seqCopySeq = -1;
@@ -218,8 +327,8 @@ struct ArenaModule : Module {
 				}
 				case MODMODE::WALK: {
 					float v = getOpInput(j);
-					offsetX[j] = random::normal() / 2000.f * v;
-					offsetY[j] = random::normal() / 2000.f * v;
+					offsetX[j] = prng.normal() / 2000.f * v;
+					offsetY[j] = prng.normal() / 2000.f * v;
 					break;
 				}
 			}
@@ -281,6 +390,14 @@ struct ArenaModule : Module {
 				params[MIX_Y_POS + i].setValue(y);
 			}
 
+			if (seqMode[i] == SEQMODE::RECORD && inputs[SEQ_INPUT + i].isConnected()) {
+				seqRecordProcess(i, args.sampleTime);
+			}
+			else if (seqRecorder[i].state.load(std::memory_order_relaxed) == SeqRecorder::RECORDING) {
+				// Mode changed or cable removed while recording, drop the recording
+				seqRecorder[i].state = SeqRecorder::IDLE;
+			}
+
 			float mixX = params[MIX_X_POS + i].getValue();
 			float mixY = params[MIX_Y_POS + i].getValue();
 			Vec mixVec = Vec(mixX, mixY);
@@ -366,6 +483,8 @@ struct ArenaModule : Module {
 				lights[MIX_SEL_LIGHT + i].setBrightness(selectedType == 1 && selectedId == i);
 			}
 		}
+
+		processCount.fetch_add(1, std::memory_order_release);
 	}
 
 	inline float getOpInput(int j) {
@@ -392,16 +511,60 @@ struct ArenaModule : Module {
 		selectedId = -1;
 	}
 
+	inline SeqItem* seqGet(int port, int seq) {
+		return seqData[port][seq].load(std::memory_order_acquire);
+	}
+
+	inline SeqItem* seqGet(int port) {
+		return seqGet(port, seqSelected[port]);
+	}
+
+	/** Replaces sequence `seq` of `port` by `s`, called from the UI thread */
+	void seqSet(int port, int seq, SeqItem* s) {
+		SeqItem* old = seqData[port][seq].exchange(s);
+		// The engine thread might still be using the old sequence in the current process()
+		seqRetired.push_back(std::make_pair(processCount.load(), old));
+		seqCollect();
+	}
+
+	/** Frees replaced sequences which are out of use, or all of them if `all` is set */
+	void seqCollect(bool all = false) {
+		uint32_t c = processCount.load(std::memory_order_acquire);
+		size_t k = 0;
+		for (size_t i = 0; i < seqRetired.size(); i++) {
+			if (all || c - seqRetired[i].first >= 2)
+				delete seqRetired[i].second;
+			else
+				seqRetired[k++] = seqRetired[i];
+		}
+		seqRetired.resize(k);
+	}
+
+	/**
+	 * Returns sequence `seq` of `port` with room for at least `length` points, the storage is
+	 * doubled if needed. Called from the UI thread.
+	 */
+	SeqItem* seqReserve(int port, int seq, int length) {
+		SeqItem* s = seqGet(port, seq);
+		if (length <= s->capacity) return s;
+		SeqItem* n = new SeqItem(std::min(std::max(2 * s->capacity, length), SEQ_LENGTH_MAX));
+		std::copy(s->x, s->x + s->length, n->x);
+		std::copy(s->y, s->y + s->length, n->y);
+		n->length = s->length;
+		seqSet(port, seq, n);
+		return n;
+	}
+
 	int seqLength(int port) {
-		return seqData[port][seqSelected[port]].length;
+		return seqGet(port)->length;
 	}
 
 	void seqClear(int port) {
-		seqData[port][seqSelected[port]].length = 0;
+		seqSet(port, seqSelected[port], new SeqItem(0));
 	}
 
 	Vec seqValue(int port, float pos) {
-		SeqItem* s = &seqData[port][seqSelected[port]];
+		SeqItem* s = seqGet(port);
 		if (s->length == 0) return Vec(0.5f, 0.5f);
 		int l = s->length - 1;
 
@@ -451,7 +614,7 @@ struct ArenaModule : Module {
 					int t = seqSelected[port];
 					do 
 						seqSelected[port] = (seqSelected[port] + 1) % SEQ_COUNT;
-					while (seqData[port][seqSelected[port]].length == 0 && seqSelected[port] != t);
+					while (seqGet(port)->length == 0 && seqSelected[port] != t);
 				}
 				break;
 			}
@@ -460,23 +623,23 @@ struct ArenaModule : Module {
 					int t = seqSelected[port];
 					do 
 						seqSelected[port] = (seqSelected[port] - 1 + SEQ_COUNT) % SEQ_COUNT;
-					while (seqData[port][seqSelected[port]].length == 0 && seqSelected[port] != t);
+					while (seqGet(port)->length == 0 && seqSelected[port] != t);
 				}
 				break;
 			}
 			case SEQMODE::TRIG_RANDOM_16:
 				if (seqTrigger[port].process(inputs[SEQ_INPUT + port].getVoltage())) {
-					seqSelected[port] = std::floor(rescale(random::uniform(), 0.f, 1.f, 0.f, 16.f));
+					seqSelected[port] = prng.uniformInt(16);
 				}
 				break;
 			case SEQMODE::TRIG_RANDOM_8:
 				if (seqTrigger[port].process(inputs[SEQ_INPUT + port].getVoltage())) {
-					seqSelected[port] = std::floor(rescale(random::uniform(), 0.f, 1.f, 0.f, 8.f));
+					seqSelected[port] = prng.uniformInt(8);
 				}
 				break;
 			case SEQMODE::TRIG_RANDOM_4:
 				if (seqTrigger[port].process(inputs[SEQ_INPUT + port].getVoltage())) {
-					seqSelected[port] = std::floor(rescale(random::uniform(), 0.f, 1.f, 0.f, 4.f));
+					seqSelected[port] = prng.uniformInt(4);
 				}
 				break;
 			case SEQMODE::C4: {
@@ -489,156 +652,220 @@ struct ArenaModule : Module {
 				seqSelected[port] = s;
 				break;
 			}
+			case SEQMODE::RECORD:
+				// Handled by seqRecordProcess()
+				break;
 		}
 	}
 
-	void seqRandomize(int port) {
-		seqData[port][seqSelected[port]].length = 0;
+	/** Records the position of mix port `port` into the selected sequence while SEQ is high */
+	void seqRecordProcess(int port, float sampleTime) {
+		SeqRecorder* r = &seqRecorder[port];
+		bool trig = seqTrigger[port].process(inputs[SEQ_INPUT + port].getVoltage());
+		switch (r->state.load(std::memory_order_acquire)) {
+			case SeqRecorder::IDLE: {
+				if (!trig) return;
+				r->seq = seqSelected[port];
+				r->length = 0;
+				r->phase = 0.f;
+				r->state = SeqRecorder::RECORDING;
+				break;
+			}
+			case SeqRecorder::RECORDING: {
+				break;
+			}
+			case SeqRecorder::DONE: {
+				// Waiting for the UI thread to store the last recording
+				return;
+			}
+		}
 
-		unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-		std::default_random_engine gen(seed);
-		std::normal_distribution<float> d{0.f, 0.1f};
+		if (!seqTrigger[port].isHigh() || r->length == SEQ_LENGTH_MAX) {
+			r->state.store(SeqRecorder::DONE, std::memory_order_release);
+			return;
+		}
+		r->phase -= sampleTime;
+		if (r->phase <= 0.f) {
+			r->phase += 1.f / seqRecordRate[port];
+			r->x[r->length] = params[MIX_X_POS + port].getValue();
+			r->y[r->length] = params[MIX_Y_POS + port].getValue();
+			r->length++;
+		}
+	}
+
+	/** Stores finished recordings as simplified sequences, called from the UI thread */
+	void seqRecordCommit() {
+		for (int port = 0; port < MIX_PORTS; port++) {
+			SeqRecorder* r = &seqRecorder[port];
+			if (r->state.load(std::memory_order_acquire) != SeqRecorder::DONE) continue;
+			if (r->length > 0) {
+				bool keep[SEQ_LENGTH_MAX];
+				int length = seqSimplify(r->x, r->y, r->length, SEQ_SIMPLIFY_EPSILON, keep);
+				SeqItem* s = new SeqItem(length);
+				for (int i = 0; i < r->length; i++) {
+					if (!keep[i]) continue;
+					s->x[s->length] = r->x[i];
+					s->y[s->length] = r->y[i];
+					s->length++;
+				}
+				seqSet(port, r->seq, s);
+			}
+			r->state.store(SeqRecorder::IDLE, std::memory_order_release);
+		}
+	}
+
+	void seqRandomize(int port) {
+		Prng gen;
+		gen.setSeed(random::u64());
+		auto d = [&gen]() { return gen.normal() * 0.1f; };
 		dsp::ExponentialFilter filterX;
 		dsp::ExponentialFilter filterY;
 		filterX.setLambda(0.7f);
 		filterY.setLambda(0.7f);
 
 		// Random length
-		int l = std::max(0, std::min(int(SEQ_LENGTH / 4 + d(gen) * SEQ_LENGTH / 4), SEQ_LENGTH - 1));
+		int l = std::max(0, std::min(int(SEQ_LENGTH / 4 + d() * SEQ_LENGTH / 4), SEQ_LENGTH - 1));
+		SeqItem* s = new SeqItem(l);
 
 		// Set some start-value for the exponential filters
-		filterX.out = 0.5f + d(gen);
-		filterY.out = 0.5f + d(gen);
-		int dirX = d(gen) >= 0.f ? 1 : -1;
-		int dirY = d(gen) >= 0.f ? 1 : -1;
+		filterX.out = 0.5f + d();
+		filterY.out = 0.5f + d();
+		int dirX = d() >= 0.f ? 1 : -1;
+		int dirY = d() >= 0.f ? 1 : -1;
 		float pX = 0.5f;
 		float pY = 0.5f;
 		for (int c = 0; c < l; c++) {
 			// Reduce the number of direction changes, only when rand > 0
-			if (d(gen) >= 0.5f) dirX = dirX == -1 ? 1 : -1;
+			if (d() >= 0.5f) dirX = dirX == -1 ? 1 : -1;
 			if (pX == 1.f) dirX = -1;
 			if (pX == 0.f) dirX = 1;
-			if (d(gen) >= 0.5f) dirY = dirY == -1 ? 1 : -1;
+			if (d() >= 0.5f) dirY = dirY == -1 ? 1 : -1;
 			if (pY == 1.f) dirY = -1;
 			if (pY == 0.f) dirY = 1;
 			float r;
 
-			r = d(gen);
+			r = d();
 			pX = filterX.process(1.f, pX + dirX * abs(r));
 			// Only range [0,1] is valid
 			pX = clamp(pX, 0.f, 1.f);
-			seqData[port][seqSelected[port]].x[c] = pX;
+			s->x[c] = pX;
 
-			r = d(gen);
+			r = d();
 			pY = filterY.process(1.f, pY + dirY * abs(r));
 			// Only range [0,1] is valid
 			pY = clamp(pY, 0.f, 1.f);
-			seqData[port][seqSelected[port]].y[c] = pY;
+			s->y[c] = pY;
 		}
-		seqData[port][seqSelected[port]].length = l;
+		s->length = l;
+		seqSet(port, seqSelected[port], s);
 	}
 
 	void seqPreset(int port, SEQPRESET preset, float x, float y, int parameter) {
 		auto _x = [x](float v) { return (v - 0.5f) * x + 0.5f; };
 		auto _y = [y](float v) { return (v - 0.5f) * y + 0.5f; };
 		
- 		switch (preset) {
+		SeqItem* s = NULL;
+		switch (preset) {
 			case SEQPRESET::CIRCLE: {
-				seqData[port][seqSelected[port]].length = 0;
 				int l = SEQ_LENGTH / 4;
+				s = new SeqItem(l);
 				float p = 2.f * M_PI / (l - 1);
 				for (int i = 0; i < l; i++) {
-					seqData[port][seqSelected[port]].x[i] = _x(sin(i * p) / 2.f + 0.5f);
-					seqData[port][seqSelected[port]].y[i] = _y(cos(i * p) / 2.f + 0.5f);
+					s->x[i] = _x(sin(i * p) / 2.f + 0.5f);
+					s->y[i] = _y(cos(i * p) / 2.f + 0.5f);
 				}
-				seqData[port][seqSelected[port]].length = l;
+				s->length = l;
 				break;
 			}
 			case SEQPRESET::SPIRAL: {
 				auto _s = [](float v, float s) { return (v - 0.5f) * s + 0.5f; };
-				seqData[port][seqSelected[port]].length = 0;
 				int l = SEQ_LENGTH;
+				s = new SeqItem(l);
 				float p = parameter * 2.f * M_PI / (l - 1);
 				for (int i = 0; i < l; i++) {
-					seqData[port][seqSelected[port]].x[i] = _x(_s(sin(i * p) / 2.f + 0.5f, 1.f / l * i));
-					seqData[port][seqSelected[port]].y[i] = _y(_s(cos(i * p) / 2.f + 0.5f, 1.f / l * i));
+					s->x[i] = _x(_s(sin(i * p) / 2.f + 0.5f, 1.f / l * i));
+					s->y[i] = _y(_s(cos(i * p) / 2.f + 0.5f, 1.f / l * i));
 				}
-				seqData[port][seqSelected[port]].length = l;
+				s->length = l;
 				break;
 			}
 			case SEQPRESET::SAW: {
-				seqData[port][seqSelected[port]].length = 0;
-				seqData[port][seqSelected[port]].x[0] = _x(0.f);
-				seqData[port][seqSelected[port]].y[0] = _y(1.f);
 				int c = parameter;
+				s = new SeqItem(c + 2);
+				s->x[0] = _x(0.f);
+				s->y[0] = _y(1.f);
 				for (int i = 0; i < c; i++) {
-					seqData[port][seqSelected[port]].x[i + 1] = _x(1.f / (c + 1) * (i + 1));
-					seqData[port][seqSelected[port]].y[i + 1] = _y(i % 2);
+					s->x[i + 1] = _x(1.f / (c + 1) * (i + 1));
+					s->y[i + 1] = _y(i % 2);
 				}
-				seqData[port][seqSelected[port]].x[c + 1] = _x(1.f);
-				seqData[port][seqSelected[port]].y[c + 1] = _y(0.f);
-				seqData[port][seqSelected[port]].length = c + 2;
+				s->x[c + 1] = _x(1.f);
+				s->y[c + 1] = _y(0.f);
+				s->length = c + 2;
 				break;
 			}
 			case SEQPRESET::SINE: {
-				seqData[port][seqSelected[port]].length = 0;
 				int l = SEQ_LENGTH;
+				s = new SeqItem(l);
 				float p = parameter * 2.f * M_PI / (l - 1);
 				for (int i = 0; i < l; i++) {
-					seqData[port][seqSelected[port]].x[i] = _x(1.f / l * i);
-					seqData[port][seqSelected[port]].y[i] = _y(sin(i * p) / 2.f + 0.5f);
+					s->x[i] = _x(1.f / l * i);
+					s->y[i] = _y(sin(i * p) / 2.f + 0.5f);
 				}
-				seqData[port][seqSelected[port]].length = l;
+				s->length = l;
 				break;
 			}
 			case SEQPRESET::EIGHT: {
 				auto _s = [](float v, float s) { return v / s + 0.5f; };
-				seqData[port][seqSelected[port]].length = 0;
 				int l = SEQ_LENGTH / 2.f;
+				s = new SeqItem(l);
 				float p = 2.f * M_PI / (l - 1);
 				float o = - M_PI / 2.f;
 				for (int i = 0; i < l; i++) {
-					seqData[port][seqSelected[port]].x[i] = _x(_s(std::cos(i * p + o), 2.f));
-					seqData[port][seqSelected[port]].y[i] = _y(_s(std::cos(i * p + o) * std::sin(i * p + o), 1.f));
+					s->x[i] = _x(_s(std::cos(i * p + o), 2.f));
+					s->y[i] = _y(_s(std::cos(i * p + o) * std::sin(i * p + o), 1.f));
 				}
-				seqData[port][seqSelected[port]].length = l;
+				s->length = l;
 				break;
 			}
 			case SEQPRESET::ROSE: {
 				auto _s = [](float v) { return v / 2.f + 0.5f; };
-				seqData[port][seqSelected[port]].length = 0;
 				int l = SEQ_LENGTH;
+				s = new SeqItem(l);
 				float p = (parameter % 2 == 1 ? 2.f : 1.f) * 2.f * M_PI / (l - 1);
 				for (int i = 0; i < l; i++) {
-					seqData[port][seqSelected[port]].x[i] = _x(_s(std::cos(parameter / 2.f * i * p) * std::cos(i * p)));
-					seqData[port][seqSelected[port]].y[i] = _y(_s(std::cos(parameter / 2.f * i * p) * std::sin(i * p)));
+					s->x[i] = _x(_s(std::cos(parameter / 2.f * i * p) * std::cos(i * p)));
+					s->y[i] = _y(_s(std::cos(parameter / 2.f * i * p) * std::sin(i * p)));
 				}
-				seqData[port][seqSelected[port]].length = l;
+				s->length = l;
 				break;
 			}
 		}
+		if (s) seqSet(port, seqSelected[port], s);
 	}
 
 	void seqRotate(int port, float angle) {
-		for (int i = 0; i < seqData[port][seqSelected[port]].length; i++) {
-			Vec p = Vec(seqData[port][seqSelected[port]].x[i], seqData[port][seqSelected[port]].y[i]);
+		SeqItem* s = seqGet(port);
+		for (int i = 0; i < s->length; i++) {
+			Vec p = Vec(s->x[i], s->y[i]);
 			p = p.plus(Vec(-0.5f, -0.5f));
 			p = p.rotate(angle);
 			p = p.minus(Vec(-0.5f, -0.5f));
-			seqData[port][seqSelected[port]].x[i] = std::max(0.f, std::min(p.x, 1.f));
-			seqData[port][seqSelected[port]].y[i] = std::max(0.f, std::min(p.y, 1.f));
+			s->x[i] = std::max(0.f, std::min(p.x, 1.f));
+			s->y[i] = std::max(0.f, std::min(p.y, 1.f));
 		}
 	}
 
 	void seqFlipHorizontically(int port) {
-		for (int i = 0; i < seqData[port][seqSelected[port]].length; i++) {
-			seqData[port][seqSelected[port]].y[i] = 1.f - seqData[port][seqSelected[port]].y[i];
+		SeqItem* s = seqGet(port);
+		for (int i = 0; i < s->length; i++) {
+			s->y[i] = 1.f - s->y[i];
 		}
 	}
 
 	void seqFlipVertically(int port) {
-		for (int i = 0; i < seqData[port][seqSelected[port]].length; i++) {
-			seqData[port][seqSelected[port]].x[i] = 1.f - seqData[port][seqSelected[port]].x[i];
+		SeqItem* s = seqGet(port);
+		for (int i = 0; i < s->length; i++) {
+			s->x[i] = 1.f - s->x[i];
 		}
 	}
 
@@ -649,12 +876,12 @@ struct ArenaModule : Module {
 
 	void seqPaste(int port) {
 		if (seqCopyPort >= 0) {
-			seqData[port][seqSelected[port]].length = 0;
-			for (int i = 0; i < seqData[seqCopyPort][seqCopySeq].length; i++) {
-				seqData[port][seqSelected[port]].x[i] = seqData[seqCopyPort][seqCopySeq].x[i];
-				seqData[port][seqSelected[port]].y[i] = seqData[seqCopyPort][seqCopySeq].y[i];
-			}
-			seqData[port][seqSelected[port]].length = seqData[seqCopyPort][seqCopySeq].length;
+			SeqItem* c = seqGet(seqCopyPort, seqCopySeq);
+			SeqItem* s = new SeqItem(c->length);
+			std::copy(c->x, c->x + c->length, s->x);
+			std::copy(c->y, c->y + c->length, s->y);
+			s->length = c->length;
+			seqSet(port, seqSelected[port], s);
 		}
 	}
 
@@ -674,8 +901,9 @@ struct ArenaModule : Module {
 			lastMixXpos[i] = -1.f;
 			lastMixYpos[i] = -1.f;
 			for (int j = 0; j < SEQ_COUNT; j++) {
-				seqData[i][j].length = 0;
+				seqSet(i, j, new SeqItem(0));
 			}
+			seqRecorder[i].state = SeqRecorder::IDLE;
 		}
 		seqEdit = -1;
 	}
@@ -727,18 +955,13 @@ struct ArenaModule : Module {
 			json_object_set_new(mixportJ, "seqSelected", json_integer(seqSelected[i]));
 			json_object_set_new(mixportJ, "seqMode", json_integer(seqMode[i]));
 			json_object_set_new(mixportJ, "seqInterpolate", json_integer(seqInterpolate[i]));
+			json_object_set_new(mixportJ, "seqRecordRate", json_real(seqRecordRate[i]));
 			json_t* seqDataJ = json_array();
 			for (int j = 0; j < SEQ_COUNT; j++) {
-				SeqItem* s = &seqData[i][j];
+				SeqItem* s = seqGet(i, j);
 				json_t* seqItemJ = json_object();
-				json_t* xJ = json_array();
-				json_t* yJ = json_array();
-				for (int k = 0; k < s->length; k++) {
-					json_array_append_new(xJ, json_real(s->x[k]));
-					json_array_append_new(yJ, json_real(s->y[k]));
-				}
-				json_object_set_new(seqItemJ, "x", xJ);
-				json_object_set_new(seqItemJ, "y", yJ);
+				json_object_set_new(seqItemJ, "x", Packed::toJson(s->x, s->length));
+				json_object_set_new(seqItemJ, "y", Packed::toJson(s->y, s->length));
 				json_array_append_new(seqDataJ, seqItemJ);
 			}
 			json_object_set_new(mixportJ, "seqData", seqDataJ);
@@ -748,6 +971,7 @@ struct ArenaModule : Module {
 
 		json_object_set_new(rootJ, "inportsUsed", json_integer(inportsUsed));
 		json_object_set_new(rootJ, "mixportsUsed", json_integer(mixportsUsed));
+		json_object_set_new(rootJ, "seed", prng.toJson());
 
 		return rootJ;
 	}
@@ -773,28 +997,28 @@ struct ArenaModule : Module {
 			seqSelected[mixputIndex] = json_integer_value(json_object_get(mixportJ, "seqSelected"));
 			seqMode[mixputIndex] = (SEQMODE)json_integer_value(json_object_get(mixportJ, "seqMode"));
 			seqInterpolate[mixputIndex] = (SEQINTERPOLATE)json_integer_value(json_object_get(mixportJ, "seqInterpolate"));
+			json_t* seqRecordRateJ = json_object_get(mixportJ, "seqRecordRate");
+			if (seqRecordRateJ) seqRecordRate[mixputIndex] = clamp((float)json_number_value(seqRecordRateJ), 10.f, 200.f);
 			json_t* seqDataJ = json_object_get(mixportJ, "seqData");
 			json_t* seqItemJ;
 			size_t seqItemIndex;
 			json_array_foreach(seqDataJ, seqItemIndex, seqItemJ) {
-				json_t* xsJ = json_object_get(seqItemJ, "x");
-				json_t* ysJ = json_object_get(seqItemJ, "y");
-				json_t* xJ;
-				size_t xIndex;
-				json_array_foreach(xsJ, xIndex, xJ) {
-					seqData[mixputIndex][seqItemIndex].x[xIndex] = json_real_value(xJ);
-				}
-				json_t* yJ;
-				size_t yIndex;
-				json_array_foreach(ysJ, yIndex, yJ) {
-					seqData[mixputIndex][seqItemIndex].y[yIndex] = json_real_value(yJ);
-				}
-				seqData[mixputIndex][seqItemIndex].length = yIndex;
+				if ((int)seqItemIndex >= SEQ_COUNT) break;
+				std::vector<float> x, y;
+				Packed::fromJson(json_object_get(seqItemJ, "x"), x);
+				Packed::fromJson(json_object_get(seqItemJ, "y"), y);
+				int length = std::min(std::min(x.size(), y.size()), (size_t)SEQ_LENGTH_MAX);
+				SeqItem* s = new SeqItem(length);
+				std::copy(x.begin(), x.begin() + length, s->x);
+				std::copy(y.begin(), y.begin() + length, s->y);
+				s->length = length;
+				seqSet(mixputIndex, seqItemIndex, s);
 			}
 		}
 
 		inportsUsed = json_integer_value(json_object_get(rootJ, "inportsUsed"));
 		mixportsUsed = json_integer_value(json_object_get(rootJ, "mixportsUsed"));
+		prng.fromJson(json_object_get(rootJ, "seed"));
 	}
 };
 
@@ -1014,6 +1238,40 @@ struct SeqModeMenuItem : MenuItem {
 		menu->addChild(construct<SeqModeItem>(&MenuItem::text, "Trigger random 1-4", &SeqModeItem::module, module, &SeqModeItem::id, id, &SeqModeItem::seqMode, SEQMODE::TRIG_RANDOM_4));
 		menu->addChild(construct<SeqModeItem>(&MenuItem::text, "0..10V", &SeqModeItem::module, module, &SeqModeItem::id, id, &SeqModeItem::seqMode, SEQMODE::VOLT));
 		menu->addChild(construct<SeqModeItem>(&MenuItem::text, "C4-F5", &SeqModeItem::module, module, &SeqModeItem::id, id, &SeqModeItem::seqMode, SEQMODE::C4));
+		menu->addChild(construct<SeqModeItem>(&MenuItem::text, "Record gate", &SeqModeItem::module, module, &SeqModeItem::id, id, &SeqModeItem::seqMode, SEQMODE::RECORD));
+		return menu;
+	}
+};
+
+
+template < typename MODULE >
+struct SeqRecordRateMenuItem : MenuItem {
+	SeqRecordRateMenuItem() {
+		rightText = RIGHT_ARROW;
+	}
+
+	struct SeqRecordRateItem : MenuItem {
+		MODULE* module;
+		int id;
+		float rate;
+
+		void onAction(const event::Action& e) override {
+			module->seqRecordRate[id] = rate;
+		}
+
+		void step() override {
+			rightText = module->seqRecordRate[id] == rate ? "✔" : "";
+			MenuItem::step();
+		}
+	};
+
+	MODULE* module;
+	int id;
+	Menu* createChildMenu() override {
+		Menu* menu = new Menu;
+		for (float rate : { 10.f, 25.f, 50.f, 100.f, 200.f }) {
+			menu->addChild(construct<SeqRecordRateItem>(&MenuItem::text, string::f("%.0f Hz", rate), &SeqRecordRateItem::module, module, &SeqRecordRateItem::id, id, &SeqRecordRateItem::rate, rate));
+		}
 		return menu;
 	}
 };
@@ -1733,6 +1991,7 @@ struct ArenaScreenWidget : OpaqueWidget {
 		menu->addChild(construct<RandomizeYItem>(&MenuItem::text, "Radomize IN y-pos", &RandomizeYItem::module, module));
 		menu->addChild(construct<RandomizeAmountItem>(&MenuItem::text, "Radomize IN amount", &RandomizeAmountItem::module, module));
 		menu->addChild(construct<RandomizeRadiusItem>(&MenuItem::text, "Radomize IN radius", &RandomizeRadiusItem::module, module));
+		menu->addChild(construct<PrngSeedMenuItem<MODULE>>(&MenuItem::text, "Random seed", &PrngSeedMenuItem<MODULE>::module, module));
 		menu->addChild(new MenuSeparator());
 		menu->addChild(construct<NumInportsMenuItem>(&MenuItem::text, "Number of IN-ports", &NumInportsMenuItem::module, module));
 		menu->addChild(construct<NumMixportsMenuItem>(&MenuItem::text, "Number of MIX-ports", &NumMixportsMenuItem::module, module));
@@ -1769,20 +2028,21 @@ struct ArenaSeqEditDragWidget : OpaqueWidget {
 		index = 0;
 
 		if (id >= 0) {
-			if (module->seqData[id][seq].length == 0) {
+			SeqItem* s = module->seqGet(id, seq);
+			if (s->length == 0) {
 				box.pos.x = parent->box.size.x / 2.f - radius;
 				box.pos.y = parent->box.size.y / 2.f - radius;
 			}
 			else {
-				box.pos.x = (parent->box.size.x - box.size.x) * module->seqData[id][seq].x[0];
-				box.pos.y = (parent->box.size.y - box.size.y) * module->seqData[id][seq].y[0];
+				box.pos.x = (parent->box.size.x - box.size.x) * s->x[0];
+				box.pos.y = (parent->box.size.y - box.size.y) * s->y[0];
 			}
 		}
 	}
 
 	void clear() {
 		index = 0;
-		module->seqData[id][seq].length = 0;
+		module->seqSet(id, seq, new SeqItem(0));
 	}
 
 	void draw(const Widget::DrawArgs& args) override {
@@ -1839,7 +2099,8 @@ struct ArenaSeqEditDragWidget : OpaqueWidget {
 
 		dragPos = APP->scene->rack->mousePos.minus(box.pos);
 		timerClear = true;
-		module->seqData[id][seq].length = 0;
+		index = 0;
+		module->seqSet(id, seq, new SeqItem(SEQ_LENGTH));
 	}
 
 	void onDragEnd(const event::DragEnd& e) override {
@@ -1855,14 +2116,15 @@ struct ArenaSeqEditDragWidget : OpaqueWidget {
 		box.pos = pos;
 
 		auto now = std::chrono::system_clock::now();
-		if (timerClear || now - timer > std::chrono::milliseconds{65}) {
-			if (index < SEQ_LENGTH) {
+		if (timerClear || now - timer > std::chrono::milliseconds{16}) {
+			if (index < SEQ_LENGTH_MAX) {
 				float x = pos.x / (parent->box.size.x - box.size.x);
 				float y = pos.y / (parent->box.size.y - box.size.y);
 
-				module->seqData[id][seq].x[index] = x;
-				module->seqData[id][seq].y[index] = y;
-				module->seqData[id][seq].length = index + 1;
+				SeqItem* s = module->seqReserve(id, seq, index + 1);
+				s->x[index] = x;
+				s->y[index] = y;
+				s->length = index + 1;
 				index++;
 			}
 			timer = now;
@@ -1933,7 +2195,7 @@ struct ArenaSeqEditWidget : OpaqueWidget {
 			OpaqueWidget::draw(args);
 
 			// Draw raw automation line
-			SeqItem* s = &module->seqData[lastSeqId][lastSeqSelected];
+			SeqItem* s = module->seqGet(lastSeqId, lastSeqSelected);
 			if (s->length > 1) {
 				float sizeX = box.size.x - recWidget->box.size.x;
 				float sizeY = box.size.y - recWidget->box.size.y;
@@ -2179,6 +2441,7 @@ struct ArenaSeqDisplay : LedDisplayChoice {
 		menu->addChild(construct<SeqInterpolateMenuItem<MODULE>>(&MenuItem::text, "Interpolation", &SeqInterpolateMenuItem<MODULE>::module, module, &SeqInterpolateMenuItem<MODULE>::id, id));
 		menu->addChild(new MenuSeparator());
 		menu->addChild(construct<SeqModeMenuItem<MODULE>>(&MenuItem::text, "SEQ-port", &SeqModeMenuItem<MODULE>::module, module, &SeqModeMenuItem<MODULE>::id, id));
+		menu->addChild(construct<SeqRecordRateMenuItem<MODULE>>(&MenuItem::text, "Record rate", &SeqRecordRateMenuItem<MODULE>::module, module, &SeqRecordRateMenuItem<MODULE>::id, id));
 	}
 };
 
@@ -2286,6 +2549,11 @@ struct ArenaWidget : ModuleWidget {
 		}
 	}
 
+	void step() override {
+		if (module) module->seqRecordCommit();
+		ModuleWidget::step();
+	}
+
 	void appendContextMenu(Menu* menu) override {
 		struct ManualItem : MenuItem {
 			void onAction(const event::Action &e) override {
@@ -2301,4 +2569,4 @@ struct ArenaWidget : ModuleWidget {
 
 } // namespace Arena
 
-Model* modelArena = createModel<Arena::ArenaModule<8, 4>, Arena::ArenaWidget>("Arena");
\ No newline at end of file
+Model* modelArena = createModelProfiled<Arena::ArenaModule<8, 4>, Arena::ArenaWidget>("Arena");
\ No newline at end of file
@@ -1,82 +1,316 @@
 #include "plugin.hpp"
 #include <audio.hpp>
+#include <speex/speex_resampler.h>
 #include <app.hpp>
-#include <mutex>
 #include <chrono>
 #include <thread>
-#include <mutex>
-#include <condition_variable>
+#include <atomic>
 
 
 namespace AudioInterface64 {
 
+/**
+ * Wait-free single-producer/single-consumer variant of dsp::DoubleRingBuffer.
+ * The producer may only use push(), endData(), endIncr(), capacity() and full(),
+ * the consumer shift(), startData(), startIncr(), clear(), size() and empty().
+ */
+template <typename T, size_t S>
+struct SpscDoubleRingBuffer {
+	T data[S * 2];
+	std::atomic<size_t> start{0};
+	std::atomic<size_t> end{0};
+
+	size_t mask(size_t i) const {
+		return i & (S - 1);
+	}
+
+	void push(T t) {
+		size_t e = end.load(std::memory_order_relaxed);
+		size_t i = mask(e);
+		data[i] = t;
+		data[i + S] = t;
+		end.store(e + 1, std::memory_order_release);
+	}
+
+	T shift() {
+		size_t s = start.load(std::memory_order_relaxed);
+		T t = data[mask(s)];
+		start.store(s + 1, std::memory_order_release);
+		return t;
+	}
+
+	void clear() {
+		start.store(end.load(std::memory_order_acquire), std::memory_order_release);
+	}
+
+	size_t size() const {
+		return end.load(std::memory_order_acquire) - start.load(std::memory_order_acquire);
+	}
+
+	bool empty() const {
+		return size() == 0;
+	}
+
+	bool full() const {
+		return size() >= S;
+	}
+
+	size_t capacity() const {
+		return S - size();
+	}
+
+	/** Returns a pointer to capacity() consecutive elements for appending, to be committed by endIncr() */
+	T* endData() {
+		return &data[mask(end.load(std::memory_order_relaxed))];
+	}
+
+	void endIncr(size_t n) {
+		size_t end0 = end.load(std::memory_order_relaxed);
+		size_t e = mask(end0);
+		size_t e1 = e + n;
+		size_t e2 = (e1 < S) ? e1 : S;
+		// Copy data forward
+		std::memcpy(&data[S + e], &data[e], sizeof(T) * (e2 - e));
+		if (e1 > S) {
+			// Copy data backward from the doubled block to the main block
+			std::memcpy(data, &data[S], sizeof(T) * (e1 - S));
+		}
+		end.store(end0 + n, std::memory_order_release);
+	}
+
+	/** Returns a pointer to size() consecutive elements for consuming, to be released by startIncr() */
+	const T* startData() const {
+		return &data[mask(start.load(std::memory_order_relaxed))];
+	}
+
+	void startIncr(size_t n) {
+		start.store(start.load(std::memory_order_relaxed) + n, std::memory_order_release);
+	}
+};
+
+/**
+ * Waits for cond() without locking: busy spins first, then yields and finally
+ * backs off to short sleeps. Returns false if the timeout has expired.
+ */
+template <typename F>
+bool spinWait(F cond, std::chrono::microseconds timeout) {
+	for (int i = 0; i < 64; i++) {
+		if (cond()) return true;
+	}
+	auto start = std::chrono::steady_clock::now();
+	while (!cond()) {
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		if (elapsed >= timeout) return false;
+		if (elapsed < std::chrono::milliseconds(1))
+			std::this_thread::yield();
+		else
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	return true;
+}
+
+/**
+ * Sample rate converter for interleaved frames with a variable number of channels.
+ * Works like dsp::SampleRateConverter but without padding each frame to a fixed size.
+ */
+struct PackedSampleRateConverter {
+	SpeexResamplerState* st = NULL;
+	int channels = 0;
+	int quality = SPEEX_RESAMPLER_QUALITY_DEFAULT;
+	int inRate = 44100;
+	int outRate = 44100;
+	// Keeps a resampler even at equal rates so the ratio can be adjusted by setRatio()
+	bool adaptive = false;
+	double ratio = 1.0;
+	// Resolution of setRatio(), each change of the ratio recomputes the resampler's filter
+	const double RATIO_STEP = 1e-5;
+
+	~PackedSampleRateConverter() {
+		if (st) speex_resampler_destroy(st);
+	}
+
+	void setChannels(int channels) {
+		if (channels == this->channels)
+			return;
+		this->channels = channels;
+		refreshState();
+	}
+
+	void setRates(int inRate, int outRate) {
+		if (inRate == this->inRate && outRate == this->outRate)
+			return;
+		this->inRate = inRate;
+		this->outRate = outRate;
+		refreshState();
+	}
+
+	void setQuality(int quality) {
+		if (quality == this->quality)
+			return;
+		this->quality = quality;
+		refreshState();
+	}
+
+	void setAdaptive(bool adaptive) {
+		if (adaptive == this->adaptive)
+			return;
+		this->adaptive = adaptive;
+		refreshState();
+	}
+
+	/** Scales the nominal conversion ratio inRate / outRate in steps of RATIO_STEP, e.g. for compensating clock drift */
+	void setRatio(double ratio) {
+		ratio = 1.0 + std::round((ratio - 1.0) / RATIO_STEP) * RATIO_STEP;
+		if (!st || ratio == this->ratio)
+			return;
+		this->ratio = ratio;
+		// Fractional ratio with a resolution of 1 / (100 * inRate), fine enough for RATIO_STEP
+		spx_uint32_t num = spx_uint32_t(std::round(inRate * ratio * 100.0));
+		spx_uint32_t den = spx_uint32_t(outRate) * 100;
+		speex_resampler_set_rate_frac(st, num, den, inRate, outRate);
+	}
+
+	void refreshState() {
+		if (st) {
+			speex_resampler_destroy(st);
+			st = NULL;
+		}
+		ratio = 1.0;
+		if (channels > 0 && (inRate != outRate || adaptive)) {
+			int err;
+			st = speex_resampler_init(channels, inRate, outRate, quality, &err);
+			if (err != RESAMPLER_ERR_SUCCESS) st = NULL;
+		}
+	}
+
+	/** `in` and `out` are interleaved with the number of channels, lengths are given in frames */
+	void process(const float* in, int* inFrames, float* out, int* outFrames) {
+		if (st) {
+			spx_uint32_t inLen = *inFrames;
+			spx_uint32_t outLen = *outFrames;
+			speex_resampler_process_interleaved_float(st, in, &inLen, out, &outLen);
+			*inFrames = inLen;
+			*outFrames = outLen;
+		}
+		else {
+			// Simply copy the buffer without conversion
+			int frames = std::min(*inFrames, *outFrames);
+			std::memcpy(out, in, frames * channels * sizeof(float));
+			*inFrames = frames;
+			*outFrames = frames;
+		}
+	}
+};
+
+/**
+ * PI-controller keeping the fill level of a ring buffer at a target by returning a small
+ * relative correction of the resampling ratio. The level is smoothed as it jumps by whole
+ * blocks of the audio device.
+ */
+struct DriftController {
+	// Maximum correction of the ratio, far beyond the drift of common audio clocks
+	const float MAX_CORRECTION = 0.002f;
+	const float KP = 2e-4f;
+	const float KI = 2e-5f;
+	// Time constant of the level smoothing in seconds
+	const float TAU = 1.f;
+
+	float level = -1.f;
+	float integral = 0.f;
+
+	void reset() {
+		level = -1.f;
+		integral = 0.f;
+	}
+
+	/** `level` and `target` in frames, `dt` in seconds; returns the relative correction */
+	float process(float level, float target, float dt) {
+		if (this->level < 0.f) this->level = level;
+		this->level += (level - this->level) * std::min(dt / TAU, 1.f);
+		float e = (this->level - target) / std::max(target, 1.f);
+		// Anti-windup: the integral only grows while the correction is not saturated
+		float i = clamp(integral + KI * e * dt, -MAX_CORRECTION, MAX_CORRECTION);
+		if (std::fabs(KP * e + i) < MAX_CORRECTION || std::fabs(i) < std::fabs(integral))
+			integral = i;
+		return clamp(KP * e + integral, -MAX_CORRECTION, MAX_CORRECTION);
+	}
+};
+
 template <int AUDIO_OUTPUTS, int AUDIO_INPUTS>
 struct AudioInterfacePort : audio::Port {
-	std::mutex engineMutex;
-	std::condition_variable engineCv;
-	std::mutex audioMutex;
-	std::condition_variable audioCv;
+	// Interleaved frames of the active number of channels, sizes are given in samples
 	// Audio thread produces, engine thread consumes
-	dsp::DoubleRingBuffer<dsp::Frame<AUDIO_INPUTS>, (1 << 15)> inputBuffer;
+	SpscDoubleRingBuffer<float, (1 << 18)> inputBuffer;
 	// Audio thread consumes, engine thread produces
-	dsp::DoubleRingBuffer<dsp::Frame<AUDIO_OUTPUTS>, (1 << 15)> outputBuffer;
-	bool active = false;
-
-	std::chrono::duration<int64_t, std::milli> timeout = std::chrono::milliseconds(100);
+	SpscDoubleRingBuffer<float, (1 << 18)> outputBuffer;
+	std::atomic<bool> active{false};
+
+	// Channels of the interleaved frames, set by the audio thread before bumping streamGeneration
+	std::atomic<int> inputStride{0};
+	std::atomic<int> outputStride{0};
+	// Bumped by the audio thread whenever the stream is (re)activated or the channels change
+	std::atomic<uint32_t> streamGeneration{0};
+	// Acknowledged by the engine thread after it switched to the current strides
+	std::atomic<uint32_t> engineGeneration{0};
+	// Generation outputBuffer has last been cleared for, owned by the audio thread
+	uint32_t outputGeneration = 0;
+
+	// Blocks the engine thread did not deliver enough output frames for
+	std::atomic<uint32_t> underruns{0};
+	// Blocks of input frames which had to be dropped as the engine thread did not consume them
+	std::atomic<uint32_t> overruns{0};
 
 	~AudioInterfacePort() {
-		// Close stream here before destructing AudioInterfacePort, so the mutexes are still valid when waiting to close.
+		// Close stream here before destructing AudioInterfacePort, so the buffers are still valid when waiting to close.
 		setDeviceId(-1, 0);
 	}
 
 	void processStream(const float* input, float* output, int frames) override {
 		// Reactivate idle stream
-		if (!active) {
+		if (!active || numInputs != inputStride || numOutputs != outputStride) {
+			inputStride = numInputs;
+			outputStride = numOutputs;
+			streamGeneration++;
 			active = true;
-			inputBuffer.clear();
-			outputBuffer.clear();
 		}
 
 		if (numInputs > 0) {
 			// TODO Do we need to wait on the input to be consumed here? Experimentally, it works fine if we don't.
-			for (int i = 0; i < frames; i++) {
-				if (inputBuffer.full())
-					break;
-				dsp::Frame<AUDIO_INPUTS> inputFrame;
-				std::memset(&inputFrame, 0, sizeof(inputFrame));
-				std::memcpy(&inputFrame, &input[numInputs * i], numInputs * sizeof(float));
-				inputBuffer.push(inputFrame);
-			}
+			// Whole frames only, the engine thread clears inputBuffer on a new generation
+			int n = std::min(frames, (int) (inputBuffer.capacity() / numInputs));
+			std::memcpy(inputBuffer.endData(), input, n * numInputs * sizeof(float));
+			inputBuffer.endIncr(n * numInputs);
+			if (n < frames) overruns++;
 		}
 
 		if (numOutputs > 0) {
-			std::unique_lock<std::mutex> lock(audioMutex);
-			auto cond = [&] {
-				return (outputBuffer.size() >= (size_t) frames);
-			};
-			if (audioCv.wait_for(lock, timeout, cond)) {
-				// Consume audio block
-				for (int i = 0; i < frames; i++) {
-					dsp::Frame<AUDIO_OUTPUTS> f = outputBuffer.shift();
-					for (int j = 0; j < numOutputs; j++) {
-						output[numOutputs * i + j] = clamp(f.samples[j], -1.f, 1.f);
-					}
+			int available = 0;
+			if (engineGeneration == streamGeneration) {
+				// Frames pushed before the engine switched to the current stride are dropped
+				if (outputGeneration != streamGeneration) {
+					outputBuffer.clear();
+					outputGeneration = streamGeneration;
 				}
+				// Consume whatever the engine has delivered, the audio thread never waits for it
+				available = std::min((int) (outputBuffer.size() / numOutputs), frames);
+				const float* data = outputBuffer.startData();
+				for (int i = 0; i < available * numOutputs; i++) {
+					output[i] = clamp(data[i], -1.f, 1.f);
+				}
+				outputBuffer.startIncr(available * numOutputs);
 			}
-			else {
-				// Timed out, fill output with zeros
-				std::memset(output, 0, frames * numOutputs * sizeof(float));
+			if (available < frames) {
+				// Fill missing frames with zeros on underflow
+				std::memset(&output[numOutputs * available], 0, (frames - available) * numOutputs * sizeof(float));
+				if (engineGeneration == streamGeneration) underruns++;
 				// DEBUG("Audio Interface Port underflow");
 			}
 		}
-
-		// Notify engine when finished processing
-		engineCv.notify_one();
 	}
 
 	void onCloseStream() override {
-		inputBuffer.clear();
-		outputBuffer.clear();
+		// The buffers are cleared by their consumers on reactivation
+		active = false;
 	}
 
 	void onChannelsChange() override {
@@ -103,52 +337,196 @@ struct AudioInterface : Module {
 		NUM_LIGHTS
 	};
 
+	// Number of frames buffered in rack's sample rate
+	static const int ENGINE_FRAMES = 16;
+	// Engine frames between updates of the drift compensation
+	static const int DRIFT_FRAMES = 256;
+	// Minimum time between two changes of the converters' ratios in seconds, as each change
+	// recomputes the resampler's filter on the engine thread
+	const float RATIO_INTERVAL = 0.1f;
+
 	AudioInterfacePort<AUDIO_OUTPUTS, AUDIO_INPUTS> port;
 	int lastSampleRate = 0;
 	int lastNumOutputs = -1;
 	int lastNumInputs = -1;
 
-	dsp::SampleRateConverter<AUDIO_INPUTS> inputSrc;
-	dsp::SampleRateConverter<AUDIO_OUTPUTS> outputSrc;
-
-	// in rack's sample rate
-	dsp::DoubleRingBuffer<dsp::Frame<AUDIO_INPUTS>, 16> inputBuffer;
-	dsp::DoubleRingBuffer<dsp::Frame<AUDIO_OUTPUTS>, 16> outputBuffer;
-
-	std::chrono::duration<int64_t, std::milli> timeout = std::chrono::milliseconds(200);
+	// Generation of the port's stream the strides below belong to
+	uint32_t generation = 0;
+	int inputStride = 0;
+	int outputStride = 0;
+	// Device and engine run at the same sample rate, the converters are bypassed
+	bool direct = false;
+
+	/** [Stored to JSON] */
+	int srcQuality = SPEEX_RESAMPLER_QUALITY_DEFAULT;
+	// Time spent in the sample rate converters and the number of engine frames processed meanwhile
+	std::atomic<int64_t> srcNanos{0};
+	std::atomic<int64_t> srcFrames{0};
+
+	/** [Stored to JSON] */
+	bool driftCompensation = false;
+	DriftController inputDrift;
+	DriftController outputDrift;
+	// Target fill levels of the port's buffers in frames of the device, 0 if not determined yet
+	float inputTarget = 0.f;
+	float outputTarget = 0.f;
+	uint32_t lastUnderruns = 0;
+	// Time since the last change of the converters' ratios in seconds
+	float ratioTime = 0.f;
+	// Frames buffered between the device and the engine, in the device's sample rate
+	std::atomic<int> latency{0};
+
+	PackedSampleRateConverter inputSrc;
+	PackedSampleRateConverter outputSrc;
+
+	// in rack's sample rate, interleaved frames of the active number of channels
+	dsp::DoubleRingBuffer<float, ENGINE_FRAMES * AUDIO_INPUTS> inputBuffer;
+	dsp::DoubleRingBuffer<float, ENGINE_FRAMES * AUDIO_OUTPUTS> outputBuffer;
+
+	std::chrono::microseconds timeout = std::chrono::milliseconds(200);
 
 	dsp::ClockDivider lightDivider;
+	dsp::ClockDivider driftDivider;
 
 	AudioInterface() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 		port.maxChannels = std::max(AUDIO_OUTPUTS, AUDIO_INPUTS);
 		onSampleRateChange();
 		lightDivider.setDivision(1024);
+		driftDivider.setDivision(DRIFT_FRAMES);
 	}
 
 	void process(const ProcessArgs& args) override {
+		// Switch to the current channels of the stream
+		uint32_t g = port.streamGeneration;
+		bool d = port.sampleRate == (int) args.sampleRate && !driftCompensation;
+		if (g != generation || d != direct) {
+			generation = g;
+			direct = d;
+			inputStride = port.inputStride;
+			outputStride = port.outputStride;
+			if (g != port.engineGeneration) port.inputBuffer.clear();
+			inputBuffer.clear();
+			outputBuffer.clear();
+			driftReset();
+			port.engineGeneration = g;
+		}
+
+		if (driftDivider.process()) {
+			driftProcess(args);
+		}
+
+		if (direct) {
+			processDirect();
+		}
+		else {
+			processSrc(args);
+		}
+
+		if (lastNumInputs != inputStride) {
+			lastNumInputs = inputStride;
+			for (int i = inputStride; i < AUDIO_INPUTS; i++) {
+				outputs[AUDIO_OUTPUT + i].setVoltage(0.f);
+			}
+		}
+
+		// Set channel lights infrequently
+		if (lightDivider.process()) {
+			// Turn on light if at least one port is enabled in the nearby pair
+			for (int i = 0; i < AUDIO_INPUTS / 2; i++)
+				lights[INPUT_LIGHT + i].setBrightness(port.active && port.numOutputs >= 2 * i + 1);
+			for (int i = 0; i < AUDIO_OUTPUTS / 2; i++)
+				lights[OUTPUT_LIGHT + i].setBrightness(port.active && port.numInputs >= 2 * i + 1);
+		}
+	}
+
+	/**
+	 * Device and engine run at the same sample rate: frames are copied between the port's
+	 * buffers and the ports of the module without any resampling.
+	 */
+	void processDirect() {
+		// Inputs: audio engine -> rack engine
+		if (port.active && inputStride > 0) {
+			// Wait until inputs are present
+			// Give up after a timeout in case the audio device is being unresponsive.
+			auto cond = [&] {
+				return (port.inputBuffer.size() >= (size_t) inputStride);
+			};
+			if (spinWait(cond, timeout)) {
+				const float* inputFrame = port.inputBuffer.startData();
+				for (int i = 0; i < inputStride; i++) {
+					outputs[AUDIO_OUTPUT + i].setVoltage(10.f * inputFrame[i]);
+				}
+				port.inputBuffer.startIncr(inputStride);
+			}
+			else {
+				// Give up on pulling input
+				port.active = false;
+				// DEBUG("Audio Interface underflow");
+			}
+		}
+		else {
+			for (int i = 0; i < inputStride; i++) {
+				outputs[AUDIO_OUTPUT + i].setVoltage(0.f);
+			}
+		}
+
+		// Outputs: rack engine -> audio engine
+		if (port.active && outputStride > 0) {
+			// Wait until enough outputs are consumed, keeping the same headroom as the SRC path
+			// Give up after a timeout in case the audio device is being unresponsive.
+			auto cond = [&] {
+				return (port.outputBuffer.size() < (size_t) ((port.blockSize + ENGINE_FRAMES) * outputStride));
+			};
+			if (!cond())
+				APP->engine->yieldWorkers();
+			if (spinWait(cond, timeout)) {
+				float* outputFrame = port.outputBuffer.endData();
+				for (int i = 0; i < outputStride; i++) {
+					outputFrame[i] = inputs[AUDIO_INPUT + i].isConnected() ? inputs[AUDIO_INPUT + i].getVoltageSum() / 10.f : 0.f;
+				}
+				port.outputBuffer.endIncr(outputStride);
+			}
+			else {
+				// Give up on pushing output
+				port.active = false;
+				// DEBUG("Audio Interface underflow");
+			}
+		}
+	}
+
+	void processSrc(const ProcessArgs& args) {
 		// Update SRC states
+		inputSrc.setQuality(srcQuality);
+		outputSrc.setQuality(srcQuality);
+
 		inputSrc.setRates(port.sampleRate, args.sampleRate);
 		outputSrc.setRates(args.sampleRate, port.sampleRate);
 
-		inputSrc.setChannels(port.numInputs);
-		outputSrc.setChannels(port.numOutputs);
+		inputSrc.setChannels(inputStride);
+		outputSrc.setChannels(outputStride);
+
+		inputSrc.setAdaptive(driftCompensation);
+		outputSrc.setAdaptive(driftCompensation);
+
+		srcFrames++;
 
 		// Inputs: audio engine -> rack engine
-		if (port.active && port.numInputs > 0) {
+		if (port.active && inputStride > 0 && inputBuffer.size() < (size_t) inputStride) {
 			// Wait until inputs are present
 			// Give up after a timeout in case the audio device is being unresponsive.
-			std::unique_lock<std::mutex> lock(port.engineMutex);
 			auto cond = [&] {
-				return (!port.inputBuffer.empty());
+				return (port.inputBuffer.size() >= (size_t) inputStride);
 			};
-			if (port.engineCv.wait_for(lock, timeout, cond)) {
+			if (spinWait(cond, timeout)) {
 				// Convert inputs
-				int inLen = port.inputBuffer.size();
-				int outLen = inputBuffer.capacity();
+				int inLen = port.inputBuffer.size() / inputStride;
+				int outLen = ENGINE_FRAMES - inputBuffer.size() / inputStride;
+				auto t0 = std::chrono::steady_clock::now();
 				inputSrc.process(port.inputBuffer.startData(), &inLen, inputBuffer.endData(), &outLen);
-				port.inputBuffer.startIncr(inLen);
-				inputBuffer.endIncr(outLen);
+				srcNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+				port.inputBuffer.startIncr(inLen * inputStride);
+				inputBuffer.endIncr(outLen * inputStride);
 			}
 			else {
 				// Give up on pulling input
@@ -158,53 +536,47 @@ struct AudioInterface : Module {
 		}
 
 		// Take input from buffer
-		dsp::Frame<AUDIO_INPUTS> inputFrame;
-		if (!inputBuffer.empty()) {
-			inputFrame = inputBuffer.shift();
+		if (inputStride > 0 && inputBuffer.size() >= (size_t) inputStride) {
+			const float* inputFrame = inputBuffer.startData();
+			for (int i = 0; i < inputStride; i++) {
+				outputs[AUDIO_OUTPUT + i].setVoltage(10.f * inputFrame[i]);
+			}
+			inputBuffer.startIncr(inputStride);
 		}
 		else {
-			std::memset(&inputFrame, 0, sizeof(inputFrame));
-		}
-		for (int i = 0; i < port.numInputs; i++) {
-			outputs[AUDIO_OUTPUT + i].setVoltage(10.f * inputFrame.samples[i]);
-		}		
-		if (lastNumInputs != port.numInputs) {
-			lastNumInputs = port.numInputs;
-			for (int i = port.numInputs; i < AUDIO_INPUTS; i++) {
+			for (int i = 0; i < inputStride; i++) {
 				outputs[AUDIO_OUTPUT + i].setVoltage(0.f);
 			}
 		}
-		
+
 		// Outputs: rack engine -> audio engine
-		if (port.active && port.numOutputs > 0) {
+		if (port.active && outputStride > 0) {
 			// Get and push output SRC frame
-			if (!outputBuffer.full()) {
-				dsp::Frame<AUDIO_OUTPUTS> outputFrame;
-				std::memset(&outputFrame, 0, sizeof(outputFrame));
-				for (int i = 0; i < port.numOutputs; i++) {
-					if (inputs[AUDIO_INPUT + i].isConnected()) {
-						outputFrame.samples[i] = inputs[AUDIO_INPUT + i].getVoltageSum() / 10.f;
-					}
+			if (outputBuffer.size() < (size_t) (ENGINE_FRAMES * outputStride)) {
+				float* outputFrame = outputBuffer.endData();
+				for (int i = 0; i < outputStride; i++) {
+					outputFrame[i] = inputs[AUDIO_INPUT + i].isConnected() ? inputs[AUDIO_INPUT + i].getVoltageSum() / 10.f : 0.f;
 				}
-				outputBuffer.push(outputFrame);
+				outputBuffer.endIncr(outputStride);
 			}
 
-			if (outputBuffer.full()) {
+			if (outputBuffer.size() >= (size_t) (ENGINE_FRAMES * outputStride)) {
 				// Wait until enough outputs are consumed
 				// Give up after a timeout in case the audio device is being unresponsive.
 				auto cond = [&] {
-					return (port.outputBuffer.size() < (size_t) port.blockSize);
+					return (port.outputBuffer.size() < (size_t) (outputLimit() * outputStride));
 				};
 				if (!cond())
 					APP->engine->yieldWorkers();
-				std::unique_lock<std::mutex> lock(port.engineMutex);
-				if (port.engineCv.wait_for(lock, timeout, cond)) {
+				if (spinWait(cond, timeout)) {
 					// Push converted output
-					int inLen = outputBuffer.size();
-					int outLen = port.outputBuffer.capacity();
+					int inLen = outputBuffer.size() / outputStride;
+					int outLen = port.outputBuffer.capacity() / outputStride;
+					auto t0 = std::chrono::steady_clock::now();
 					outputSrc.process(outputBuffer.startData(), &inLen, port.outputBuffer.endData(), &outLen);
-					outputBuffer.startIncr(inLen);
-					port.outputBuffer.endIncr(outLen);
+					srcNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+					outputBuffer.startIncr(inLen * outputStride);
+					port.outputBuffer.endIncr(outLen * outputStride);
 				}
 				else {
 					// Give up on pushing output
@@ -213,30 +585,90 @@ struct AudioInterface : Module {
 					// DEBUG("Audio Interface underflow");
 				}
 			}
+		}
+	}
+
+	void driftReset() {
+		inputDrift.reset();
+		outputDrift.reset();
+		inputTarget = outputTarget = 0.f;
+		lastUnderruns = port.underruns;
+		ratioTime = 0.f;
+	}
 
-			// Notify audio thread that an output is potentially ready
-			port.audioCv.notify_one();
+	/**
+	 * Keeps the fill levels of the port's buffers at their targets by slightly adjusting the
+	 * ratios of the converters, so clock drift between the audio device and the engine neither
+	 * leads to dropouts nor to growing latency. Each output underrun raises the target by half a
+	 * block, up to four blocks.
+	 */
+	void driftProcess(const ProcessArgs& args) {
+		float blockSize = std::max(port.blockSize, 1);
+		if (inputTarget == 0.f) inputTarget = blockSize;
+		if (outputTarget == 0.f) outputTarget = blockSize / 2.f;
+		uint32_t u = port.underruns;
+		if (u != lastUnderruns) {
+			lastUnderruns = u;
+			outputTarget = std::min(outputTarget + blockSize / 2.f, 4.f * blockSize);
 		}
 
-		// Set channel lights infrequently
-		if (lightDivider.process()) {
-			// Turn on light if at least one port is enabled in the nearby pair
-			for (int i = 0; i < AUDIO_INPUTS / 2; i++)
-				lights[INPUT_LIGHT + i].setBrightness(port.active && port.numOutputs >= 2 * i + 1);
-			for (int i = 0; i < AUDIO_OUTPUTS / 2; i++)
-				lights[OUTPUT_LIGHT + i].setBrightness(port.active && port.numInputs >= 2 * i + 1);
+		float dt = DRIFT_FRAMES * args.sampleTime;
+		float engineToDevice = port.sampleRate / args.sampleRate;
+		ratioTime += dt;
+		bool ratioUpdate = !direct && ratioTime >= RATIO_INTERVAL;
+		if (ratioUpdate) ratioTime = 0.f;
+		float l = 0.f;
+		if (inputStride > 0) {
+			float level = port.inputBuffer.size() / inputStride;
+			float c = inputDrift.process(level, inputTarget, dt);
+			if (ratioUpdate) inputSrc.setRatio(1.0 + c);
+			l += level + inputBuffer.size() / inputStride * engineToDevice;
 		}
+		if (outputStride > 0) {
+			float level = port.outputBuffer.size() / outputStride;
+			float c = outputDrift.process(level, outputTarget, dt);
+			// A level above the target needs fewer device frames per engine frame, i.e. a
+			// higher ratio just like on the input side
+			if (ratioUpdate) outputSrc.setRatio(1.0 + c);
+			l += level + outputBuffer.size() / outputStride * engineToDevice;
+		}
+		latency = int(l);
+	}
+
+	/** Fill level of the port's output buffer in frames the engine waits for to fall below */
+	int outputLimit() {
+		if (outputTarget == 0.f) return port.blockSize;
+		return int(outputTarget + port.blockSize / 2);
+	}
+
+	/** Share of realtime spent in the sample rate converters, in percent */
+	float getSrcLoad() {
+		float t = srcFrames * APP->engine->getSampleTime();
+		return t > 0.f ? 100.f * (srcNanos * 1e-9f) / t : 0.f;
+	}
+
+	void resetCounters() {
+		port.underruns = 0;
+		port.overruns = 0;
+		srcNanos = 0;
+		srcFrames = 0;
 	}
 
 	json_t* dataToJson() override {
 		json_t* rootJ = json_object();
 		json_object_set_new(rootJ, "audio", port.toJson());
+		json_object_set_new(rootJ, "srcQuality", json_integer(srcQuality));
+		json_object_set_new(rootJ, "driftCompensation", json_boolean(driftCompensation));
 		return rootJ;
 	}
 
 	void dataFromJson(json_t* rootJ) override {
 		json_t* audioJ = json_object_get(rootJ, "audio");
 		port.fromJson(audioJ);
+		json_t* srcQualityJ = json_object_get(rootJ, "srcQuality");
+		if (srcQualityJ) srcQuality = clamp((int) json_integer_value(srcQualityJ), 0, 10);
+		json_t* driftCompensationJ = json_object_get(rootJ, "driftCompensation");
+		if (driftCompensationJ) driftCompensation = json_boolean_value(driftCompensationJ);
 	}
 
 	void onReset() override {
@@ -323,8 +755,83 @@ struct AudioInterface64Widget : ModuleWidget {
 		audioWidget->setAudioPort(module ? &module->port : NULL);
 		addChild(audioWidget);
 	}
+
+	void appendContextMenu(Menu* menu) override {
+		TAudioInterface* module = dynamic_cast<TAudioInterface*>(this->module);
+		assert(module);
+
+		struct SrcQualityMenuItem : MenuItem {
+			TAudioInterface* module;
+			SrcQualityMenuItem() {
+				rightText = RIGHT_ARROW;
+			}
+
+			Menu* createChildMenu() override {
+				struct SrcQualityItem : MenuItem {
+					TAudioInterface* module;
+					int srcQuality;
+					void onAction(const event::Action& e) override {
+						module->srcQuality = srcQuality;
+					}
+					void step() override {
+						rightText = module->srcQuality == srcQuality ? "✔" : "";
+						MenuItem::step();
+					}
+				};
+
+				Menu* menu = new Menu;
+				menu->addChild(construct<SrcQualityItem>(&MenuItem::text, "Low", &SrcQualityItem::module, module, &SrcQualityItem::srcQuality, 1));
+				menu->addChild(construct<SrcQualityItem>(&MenuItem::text, "Default", &SrcQualityItem::module, module, &SrcQualityItem::srcQuality, SPEEX_RESAMPLER_QUALITY_DEFAULT));
+				menu->addChild(construct<SrcQualityItem>(&MenuItem::text, "Desktop", &SrcQualityItem::module, module, &SrcQualityItem::srcQuality, SPEEX_RESAMPLER_QUALITY_DESKTOP));
+				menu->addChild(construct<SrcQualityItem>(&MenuItem::text, "Best", &SrcQualityItem::module, module, &SrcQualityItem::srcQuality, SPEEX_RESAMPLER_QUALITY_MAX));
+				return menu;
+			}
+		};
+
+		struct DriftCompensationItem : MenuItem {
+			TAudioInterface* module;
+			void onAction(const event::Action& e) override {
+				module->driftCompensation ^= true;
+			}
+			void step() override {
+				rightText = module->driftCompensation ? "✔" : "";
+				MenuItem::step();
+			}
+		};
+
+		struct LatencyLabel : MenuLabel {
+			TAudioInterface* module;
+			void step() override {
+				text = string::f("Latency %i samples", (int) module->latency);
+				MenuLabel::step();
+			}
+		};
+
+		struct StatsLabel : MenuLabel {
+			TAudioInterface* module;
+			void step() override {
+				text = string::f("Underruns %u, overruns %u, resampler %.1f%%", (unsigned) module->port.underruns, (unsigned) module->port.overruns, module->getSrcLoad());
+				MenuLabel::step();
+			}
+		};
+
+		struct ResetCountersItem : MenuItem {
+			TAudioInterface* module;
+			void onAction(const event::Action& e) override {
+				module->resetCounters();
+			}
+		};
+
+		menu->addChild(new MenuSeparator());
+		menu->addChild(construct<SrcQualityMenuItem>(&MenuItem::text, "Resampling quality", &SrcQualityMenuItem::module, module));
+		menu->addChild(construct<DriftCompensationItem>(&MenuItem::text, "Drift compensation", &DriftCompensationItem::module, module));
+		menu->addChild(new MenuSeparator());
+		menu->addChild(construct<LatencyLabel>(&LatencyLabel::module, module));
+		menu->addChild(construct<StatsLabel>(&StatsLabel::module, module));
+		menu->addChild(construct<ResetCountersItem>(&MenuItem::text, "Reset counters", &ResetCountersItem::module, module));
+	}
 };
 
 } // namespace AudioInterface64
 
-Model* modelAudioInterface64 = createModel<AudioInterface64::AudioInterface<64, 64>, AudioInterface64::AudioInterface64Widget>("AudioInterface64");
\ No newline at end of file
+Model* modelAudioInterface64 = createModelProfiled<AudioInterface64::AudioInterface<64, 64>, AudioInterface64::AudioInterface64Widget>("AudioInterface64");
\ No newline at end of file
@@ -6,6 +6,11 @@ const int BOLT_OP_NOR = 1;
 const int BOLT_OP_XOR = 2;
 const int BOLT_OP_OR = 3;
 const int BOLT_OP_NAND = 4;
+const int BOLT_OP_TABLE = 5;
+
+// The truth table is indexed by the packed states of up to eight inputs
+const int BOLT_TABLE_INPUTS = 8;
+const int BOLT_TABLE_SIZE = 1 << BOLT_TABLE_INPUTS;
 
 const int BOLT_OPCV_MODE_10V = 0;
 const int BOLT_OPCV_MODE_C4 = 1;
@@ -39,6 +44,8 @@ struct Bolt : Module {
     int op = 0;
     int opCvMode = BOLT_OPCV_MODE_10V;
     int outCvMode = BOLT_OUTCV_MODE_GATE;
+    /** [Stored to JSON] user-defined output for every combination of input states, used by BOLT_OP_TABLE */
+    bool table[BOLT_TABLE_SIZE];
 
     bool out[16];
 
@@ -61,6 +68,7 @@ struct Bolt : Module {
     void onReset() override {
         Module::onReset();
         op = 0;
+        tableFromOp(BOLT_OP_AND);
         for (int c = 0; c < 16; c++) {
             out[c] = false;
             outPulseGenerator[c].reset();
@@ -70,7 +78,7 @@ struct Bolt : Module {
   	void process(const ProcessArgs &args) override {
         // OP-button
         if (opButtonTrigger.process(params[OP_PARAM].getValue())) {
-            op = (op + 1) % 5;
+            op = nextOp();
         }
 
         // OP-input, monophonic
@@ -84,7 +92,7 @@ struct Bolt : Module {
                     break;
                 case BOLT_OPCV_MODE_TRIG:
                     if (opCvTrigger.process(inputs[OP_INPUT].getVoltage()))
-                        op = (op + 1) % 5;
+                        op = nextOp();
                     break;
             }
         }
@@ -97,17 +105,18 @@ struct Bolt : Module {
             }
             outputs[OUTPUT].setChannels(maxChannels);
 
+            // Evaluate the operator on all channels at once, bit c holds the result of channel c
+            uint16_t value = getOutMask();
+            // Channels to be updated, channels with a connected trigger-channel only on a trigger
+            int trigChannels = inputs[TRIG_INPUT].getChannels();
+            uint16_t update = ~((1 << trigChannels) - 1);
+            for (int c = 0; c < trigChannels; c++) {
+                if (trigTrigger[c].process(inputs[TRIG_INPUT].getVoltage(c)))
+                    update |= 1 << c;
+            }
+
             for (int c = 0; c < maxChannels; c++) {
-                bool b = out[c];
-                if (inputs[TRIG_INPUT].getChannels() > c) {
-                    // if trigger-channel is connected update voltage on trigger
-                    if (trigTrigger[c].process(inputs[TRIG_INPUT].getVoltage(c))) {
-                        b = getOutValue(c);
-                    }
-                }
-                else {
-                    b = getOutValue(c);
-                }
+                bool b = (update >> c) & 1 ? (value >> c) & 1 : out[c];
                 switch (outCvMode) {
                     case BOLT_OUTCV_MODE_GATE:
                         out[c] = b;
@@ -129,59 +138,87 @@ struct Bolt : Module {
 
         if (lightDivider.process()) {
 			for (int c = 0; c < 5; c++) {
-				lights[OP_LIGHTS + c].setBrightness(op == c);
+				// All lights are on for the truth table
+				lights[OP_LIGHTS + c].setBrightness(op == c || op == BOLT_OP_TABLE);
 			}
 		}
     }
 
-    bool getOutValue(int c) {
-        int h = 0;
-        bool o = false;
-        switch (op) {
-            case BOLT_OP_AND:
-                o = true;
-                for (int i = 0; i < 4; i++) {
-                    if (inputs[IN + i].getChannels() > c)
-                        o = o && (inputs[IN + i].getVoltage(c) >= 1.0f);
-                }
-                break;
-
-            case BOLT_OP_NOR:
-                o = false;
-                for (int i = 0; i < 4; i++) {
-                    if (inputs[IN + i].getChannels() > c)
-                        o = o || (inputs[IN + i].getVoltage(c) >= 1.0f);
-                }
-                o = !o;
-                break;
+    /**
+     * Thresholds all channels of input `i` into a bitmask, bit c is set if channel c is high.
+     * Channels beyond the input's number of channels are masked out.
+     */
+    inline uint16_t getInputMask(int i) {
+        int channels = inputs[IN + i].getChannels();
+        uint16_t m = 0;
+        for (int c = 0; c < channels; c += 4) {
+            simd::float_4 v = inputs[IN + i].getVoltageSimd<simd::float_4>(c);
+            m |= simd::movemask(v >= 1.f) << c;
+        }
+        return m & ((1 << channels) - 1);
+    }
 
-            case BOLT_OP_XOR:
-                for (int i = 0; i < 4; i++) {
-                    if (inputs[IN + i].getChannels() > c)
-                        h += (inputs[IN + i].getVoltage(c) >= 1.0f);
-                }
-                o = h % 2 == 1;
-                break;
+    /**
+     * Returns the value of the current operator for all channels as bitmask. Inputs without
+     * channel c do not take part in the operation on channel c.
+     */
+    uint16_t getOutMask() {
+        uint16_t high[4];
+        for (int i = 0; i < 4; i++) {
+            high[i] = getInputMask(i);
+        }
 
-            case BOLT_OP_OR:
-                o = false;
+        if (op == BOLT_OP_TABLE) {
+            // Look up the packed input states of every channel, missing channels count as low
+            uint16_t m = 0;
+            for (int c = 0; c < 16; c++) {
+                int k = 0;
                 for (int i = 0; i < 4; i++) {
-                    if (inputs[IN + i].getChannels() > c)
-                        o = o || (inputs[IN + i].getVoltage(c) >= 1.0f);
+                    k |= ((high[i] >> c) & 1) << i;
                 }
-                break;
+                m |= table[k] << c;
+            }
+            return m;
+        }
 
-            case BOLT_OP_NAND:
-                o = true;
-                for (int i = 0; i < 4; i++) {
-                    if (inputs[IN + i].getChannels() > c)
-                        o = o && (inputs[IN + i].getVoltage(c) >= 1.0f);
-                }
-                o = !o;
-                break;
+        // Channels with at least one low input, with at least one high input and with an odd number of high inputs
+        uint16_t low = 0, any = 0, parity = 0;
+        for (int i = 0; i < 4; i++) {
+            uint16_t present = (1 << inputs[IN + i].getChannels()) - 1;
+            low |= present & ~high[i];
+            any |= high[i];
+            parity ^= high[i];
         }
+        switch (op) {
+            case BOLT_OP_AND:   return ~low;
+            case BOLT_OP_NOR:   return ~any;
+            case BOLT_OP_XOR:   return parity;
+            case BOLT_OP_OR:    return any;
+            case BOLT_OP_NAND:  return low;
+            default:            return 0;
+        }
+    }
 
-        return o;
+    /** Button and trigger cycle through the five panel operators only, the truth table is set from the menu */
+    int nextOp() {
+        return op >= BOLT_OP_TABLE ? BOLT_OP_AND : (op + 1) % BOLT_OP_TABLE;
+    }
+
+    /** Fills the truth table with the boolean function `tableOp` applied on the four input ports */
+    void tableFromOp(int tableOp) {
+        for (int k = 0; k < BOLT_TABLE_SIZE; k++) {
+            int h = 0;
+            for (int i = 0; i < 4; i++) {
+                h += (k >> i) & 1;
+            }
+            switch (tableOp) {
+                case BOLT_OP_AND:   table[k] = h == 4; break;
+                case BOLT_OP_NOR:   table[k] = h == 0; break;
+                case BOLT_OP_XOR:   table[k] = h % 2 == 1; break;
+                case BOLT_OP_OR:    table[k] = h > 0; break;
+                case BOLT_OP_NAND:  table[k] = h < 4; break;
+            }
+        }
     }
 
     json_t *dataToJson() override {
@@ -189,6 +226,14 @@ struct Bolt : Module {
 		json_object_set_new(rootJ, "op", json_integer(op));
         json_object_set_new(rootJ, "opCvMode", json_integer(opCvMode));
         json_object_set_new(rootJ, "outCvMode", json_integer(outCvMode));
+
+        // Truth table as hex-string, each digit holds four consecutive entries
+        std::string tableS;
+        for (int k = 0; k < BOLT_TABLE_SIZE; k += 4) {
+            int d = table[k] | (table[k + 1] << 1) | (table[k + 2] << 2) | (table[k + 3] << 3);
+            tableS += "0123456789abcdef"[d];
+        }
+        json_object_set_new(rootJ, "table", json_string(tableS.c_str()));
         return rootJ;
     }
 
@@ -199,6 +244,18 @@ struct Bolt : Module {
 		opCvMode = json_integer_value(opCvModeJ);
         json_t *outCvModeJ = json_object_get(rootJ, "outCvMode");
 		outCvMode = json_integer_value(outCvModeJ);
+
+        json_t *tableJ = json_object_get(rootJ, "table");
+        if (json_is_string(tableJ)) {
+            std::string tableS = json_string_value(tableJ);
+            for (int k = 0; k < BOLT_TABLE_SIZE; k += 4) {
+                char h = k / 4 < (int)tableS.size() ? tableS[k / 4] : '0';
+                int d = (h >= 'a' && h <= 'f') ? h - 'a' + 10 : ((h >= '0' && h <= '9') ? h - '0' : 0);
+                for (int j = 0; j < 4; j++) {
+                    table[k + j] = (d >> j) & 1;
+                }
+            }
+        }
     }
 };
 
@@ -253,6 +310,49 @@ struct BoltOutCvModeMenuItem : MenuItem {
     }
 };
 
+struct BoltTableMenuItem : MenuItem {
+    struct BoltTableItem : MenuItem {
+        Bolt *module;
+        int k;
+
+        void onAction(const event::Action &e) override {
+            module->table[k] ^= true;
+        }
+
+        void step() override {
+            rightText = module->table[k] ? "✔" : "";
+            MenuItem::step();
+        }
+    };
+
+    struct BoltTableOpItem : MenuItem {
+        Bolt *module;
+        int op;
+
+        void onAction(const event::Action &e) override {
+            module->tableFromOp(op);
+        }
+    };
+
+    Bolt *module;
+    Menu *createChildMenu() override {
+        Menu *menu = new Menu;
+        menu->addChild(construct<MenuLabel>(&MenuLabel::text, "Inputs 1-4"));
+        // Only the combinations of the four input ports are shown
+        for (int k = 0; k < 16; k++) {
+            std::string text = string::f("%i %i %i %i", k & 1, (k >> 1) & 1, (k >> 2) & 1, (k >> 3) & 1);
+            menu->addChild(construct<BoltTableItem>(&MenuItem::text, text, &BoltTableItem::module, module, &BoltTableItem::k, k));
+        }
+        menu->addChild(new MenuSeparator());
+        menu->addChild(construct<BoltTableOpItem>(&MenuItem::text, "Set to AND", &BoltTableOpItem::module, module, &BoltTableOpItem::op, BOLT_OP_AND));
+        menu->addChild(construct<BoltTableOpItem>(&MenuItem::text, "Set to NOR", &BoltTableOpItem::module, module, &BoltTableOpItem::op, BOLT_OP_NOR));
+        menu->addChild(construct<BoltTableOpItem>(&MenuItem::text, "Set to XOR", &BoltTableOpItem::module, module, &BoltTableOpItem::op, BOLT_OP_XOR));
+        menu->addChild(construct<BoltTableOpItem>(&MenuItem::text, "Set to OR", &BoltTableOpItem::module, module, &BoltTableOpItem::op, BOLT_OP_OR));
+        menu->addChild(construct<BoltTableOpItem>(&MenuItem::text, "Set to NAND", &BoltTableOpItem::module, module, &BoltTableOpItem::op, BOLT_OP_NAND));
+        return menu;
+    }
+};
+
 struct BoltWidget : ModuleWidget {
 	BoltWidget(Bolt *module) {	
 		setModule(module);
@@ -299,7 +399,26 @@ struct BoltWidget : ModuleWidget {
         BoltOutCvModeMenuItem *outCvModeMenuItem = construct<BoltOutCvModeMenuItem>(&MenuItem::text, "Output mode", &BoltOutCvModeMenuItem::module, module);
         outCvModeMenuItem->rightText = RIGHT_ARROW;
         menu->addChild(outCvModeMenuItem);
+
+        menu->addChild(new MenuSeparator());
+
+        struct TableItem : MenuItem {
+            Bolt *module;
+            void onAction(const event::Action &e) override {
+                module->op = module->op == BOLT_OP_TABLE ? BOLT_OP_AND : BOLT_OP_TABLE;
+            }
+            void step() override {
+                rightText = module->op == BOLT_OP_TABLE ? "✔" : "";
+                MenuItem::step();
+            }
+        };
+
+        menu->addChild(construct<TableItem>(&MenuItem::text, "Use truth table", &TableItem::module, module));
+
+        BoltTableMenuItem *tableMenuItem = construct<BoltTableMenuItem>(&MenuItem::text, "Truth table", &BoltTableMenuItem::module, module);
+        tableMenuItem->rightText = RIGHT_ARROW;
+        menu->addChild(tableMenuItem);
     }
 };
 
-Model *modelBolt = createModel<Bolt, BoltWidget>("Bolt");
\ No newline at end of file
+Model *modelBolt = createModelProfiled<Bolt, BoltWidget>("Bolt");
\ No newline at end of file
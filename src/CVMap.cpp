@@ -179,4 +179,4 @@ struct CVMapWidget : ModuleWidget {
 
 } // namespace CVMap
 
-Model* modelCVMap = createModel<CVMap::CVMap, CVMap::CVMapWidget>("CVMap");
\ No newline at end of file
+Model* modelCVMap = createModelProfiled<CVMap::CVMap, CVMap::CVMapWidget>("CVMap");
\ No newline at end of file
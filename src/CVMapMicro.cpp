@@ -308,4 +308,4 @@ struct CVMapMicroWidget : ModuleWidget {
 
 } // namespace CVMapMicro
 
-Model* modelCVMapMicro = createModel<CVMapMicro::CVMapMicroModule, CVMapMicro::CVMapMicroWidget>("CVMapMicro");
\ No newline at end of file
+Model* modelCVMapMicro = createModelProfiled<CVMapMicro::CVMapMicroModule, CVMapMicro::CVMapMicroWidget>("CVMapMicro");
\ No newline at end of file
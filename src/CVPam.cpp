@@ -172,4 +172,4 @@ struct CVPamWidget : ModuleWidget {
 
 } // namespace CVPam
 
-Model* modelCVPam = createModel<CVPam::CVPam, CVPam::CVPamWidget>("CVPam");
+Model* modelCVPam = createModelProfiled<CVPam::CVPam, CVPam::CVPamWidget>("CVPam");
@@ -3,12 +3,17 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 #include <random>
+#include <limits>
+#include <memory>
 
 
 namespace EightFace {
 
+/** Number of slot-buttons on the panel, which make up one bank */
 const int NUM_PRESETS = 8;
+const int MAX_PRESETS = 128;
 
 enum SLOTCVMODE {
 	SLOTCVMODE_TRIG_FWD = 2,
@@ -25,6 +30,107 @@ enum MODE {
 	MODE_RIGHT = 1
 };
 
+/** Parameter values of a slot, parsed from its blobs when the slot is used for the first time */
+struct PresetParams {
+	/** Generation of the slot the values have been parsed from */
+	uint32_t generation = 0;
+	/** Parameter values of all modules in a flat array, NAN for parameters not stored */
+	std::vector<float> params;
+	/** Index of the first parameter of each module within params */
+	std::vector<int> paramOffset;
+
+	int paramCount(size_t k) {
+		return (k + 1 < paramOffset.size() ? paramOffset[k + 1] : (int)params.size()) - paramOffset[k];
+	}
+};
+
+struct PresetSlot {
+	/** Compact serialized snapshot of each module without its data, in order of the expander chain starting next to 8FACE */
+	std::vector<std::shared_ptr<std::string>> moduleBlob;
+	/** Serialized non-parameter data of each module which can only be restored by ModuleWidget::fromJson,
+	 * NULL if none. Equal data at the same position is shared between slots */
+	std::vector<std::shared_ptr<std::string>> dataBlob;
+
+	/** The following arrays are extracted when the slot is saved or loaded from the patch */
+	/** Model of each module, used for verifying the chain on load */
+	std::vector<Model*> model;
+	/** Number of parameters of all modules, used for reserving buffers */
+	size_t paramTotal = 0;
+
+	/** Incremented whenever the contents of the slot change */
+	uint32_t generation = 0;
+	/** Parameter values, NULL until parsed. Owned by the engine thread */
+	PresetParams* params = NULL;
+	/** Parameter values parsed by the worker, taken over by the engine thread on the next switch */
+	std::atomic<PresetParams*> paramsNew{NULL};
+};
+
+/**
+ * Single-producer/single-consumer mailbox which keeps only the most recent message,
+ * implemented as wait-free triple buffer.
+ */
+template <typename T>
+struct LatestMailbox {
+	static const int FRESH = 4;
+
+	T buffers[3];
+	/** Owned by the producer */
+	int writeIndex = 0;
+	/** Owned by the consumer */
+	int readIndex = 1;
+	std::atomic<int> middle{2};
+
+	/** Buffer to be filled by the producer before calling publish() */
+	T& writeBuffer() {
+		return buffers[writeIndex];
+	}
+
+	/** Publishes the write buffer, a previous message not fetched yet is handed back to the producer */
+	void publish() {
+		writeIndex = middle.exchange(writeIndex | FRESH) & ~FRESH;
+	}
+
+	bool pending() {
+		return middle.load() & FRESH;
+	}
+
+	/** Returns the most recent message or NULL if there is none since the last call */
+	T* fetch() {
+		if (!pending()) return NULL;
+		readIndex = middle.exchange(readIndex) & ~FRESH;
+		return &buffers[readIndex];
+	}
+};
+
+struct WorkerLoad {
+	ModuleWidget* mw;
+	std::shared_ptr<std::string> moduleBlob;
+	std::shared_ptr<std::string> dataBlob;
+};
+
+struct WorkerRequest {
+	uint32_t generation = 0;
+	/** Modules to be restored by ModuleWidget::fromJson, the blobs are parsed by the worker */
+	std::vector<WorkerLoad> load;
+	/** Slot to be parsed into PresetParams, -1 if none */
+	int parse = -1;
+	uint32_t parseGeneration = 0;
+	std::vector<std::shared_ptr<std::string>> parseBlob;
+
+	void clear() {
+		load.clear();
+		parse = -1;
+		parseBlob.clear();
+	}
+};
+
+struct MorphParam {
+	int module;
+	int paramId;
+	float from;
+	float to;
+};
+
 struct EightFaceModule : Module {
 	enum ParamIds {
 		MODE_PARAM,
@@ -48,6 +154,8 @@ struct EightFaceModule : Module {
 
 	/** [Stored to JSON] left? right? */
 	MODE mode = MODE_LEFT;
+	/** [Stored to JSON] capture all modules of the expander chain instead of the adjacent one */
+	bool chainMode = false;
 
 	/** [Stored to JSON] */
 	std::string pluginSlug;
@@ -57,16 +165,22 @@ struct EightFaceModule : Module {
 	std::string moduleName;
 
 	/** [Stored to JSON] */
-	bool presetSlotUsed[NUM_PRESETS];
+	bool presetSlotUsed[MAX_PRESETS];
 	/** [Stored to JSON] */
-	json_t *presetSlot[NUM_PRESETS];
+	PresetSlot presetSlot[MAX_PRESETS];
 
+	/** [Stored to JSON] number of available slots */
+	int presetTotal = NUM_PRESETS;
 	/** [Stored to JSON] */
 	int preset = 0;
 	/** [Stored to JSON] */
 	int presetCount = NUM_PRESETS;
+	/** [Stored to JSON] bank of slots currently shown on the slot-buttons */
+	int bank = 0;
 	/** [Stored to JSON] */
 	bool autoload = false;
+	/** [Stored to JSON] time in seconds for morphing parameters to a loaded preset */
+	float morphTime = 0.f;
 
 	/** [Stored to JSON] mode for SEQ CV input */
 	SLOTCVMODE slotCvMode = SLOTCVMODE_TRIG_FWD;
@@ -79,14 +193,26 @@ struct EightFaceModule : Module {
 	int presetNext = -1;
 	float modeLight = 0;
 
+	/** Modules of the expander chain, refreshed on every save, load and while morphing */
+	std::vector<Module*> chain;
+	/** Ids of the modules the current preset has been applied to */
+	std::vector<int> presetAppliedIds;
+
+	std::vector<int> morphModuleIds;
+	float morphPhase = 1.f;
+	std::vector<MorphParam> morph;
+	std::vector<bool> loadData;
+
 
 	std::mutex workerMutex;
 	std::condition_variable workerCondVar;
 	std::thread* worker;
-	bool workerIsRunning = true;
-	bool workerDoProcess = false;
-	int workerPreset = -1;
-	ModuleWidget* workerModuleWidget;
+	std::atomic<bool> workerIsRunning{true};
+	LatestMailbox<WorkerRequest> workerMailbox;
+	/** Generation of the last request, owned by the engine thread */
+	uint32_t workerGeneration = 0;
+	/** Generation of the last request completed by the worker */
+	std::atomic<uint32_t> workerDoneGeneration{0};
 
 	LongPressButton typeButtons[NUM_PRESETS];
 	dsp::SchmittTrigger slotTrigger;
@@ -99,6 +225,8 @@ struct EightFaceModule : Module {
 		configParam(MODE_PARAM, 0, 1, 0, "Switch Read/write mode");
 		for (int i = 0; i < NUM_PRESETS; i++) {
 			configParam(PRESET_PARAM + i, 0, 1, 0, string::f("Preset slot %d", i + 1));
+		}
+		for (int i = 0; i < MAX_PRESETS; i++) {
 			presetSlotUsed[i] = false;
 		}
 
@@ -108,30 +236,30 @@ struct EightFaceModule : Module {
 	}
 
 	~EightFaceModule() {
-		for (int i = 0; i < NUM_PRESETS; i++) {
-			if (presetSlotUsed[i])
-				json_decref(presetSlot[i]);
-		}
 		delete randDist;
 
 		workerIsRunning = false;
-		workerDoProcess = true;
 		workerCondVar.notify_one();
 		worker->join();
 		delete worker;
+		for (WorkerRequest& r : workerMailbox.buffers) {
+			r.clear();
+		}
+		for (int i = 0; i < MAX_PRESETS; i++) {
+			presetSlotFree(i);
+		}
 	}
 
 	void onReset() override {
-		for (int i = 0; i < NUM_PRESETS; i++) {
-			if (presetSlotUsed[i]) {
-				json_decref(presetSlot[i]);
-				presetSlot[i] = NULL;
-			}
+		for (int i = 0; i < MAX_PRESETS; i++) {
+			presetSlotFree(i);
 			presetSlotUsed[i] = false;
 		}
 
+		presetTotal = NUM_PRESETS;
 		preset = -1;
 		presetCount = NUM_PRESETS;
+		bank = 0;
 		presetNext = -1;
 		modelSlug = "";
 		pluginSlug = "";
@@ -140,6 +268,10 @@ struct EightFaceModule : Module {
 		if (randDist) delete randDist;
 		randDist = new std::uniform_int_distribution<int>(0, presetCount - 1);
 		autoload = false;
+		chainMode = false;
+		morphTime = 0.f;
+		morphPhase = 1.f;
+		presetAppliedIds.clear();
 	}
 
 	void process(const ProcessArgs &args) override {
@@ -150,6 +282,8 @@ struct EightFaceModule : Module {
 			connected = c ? 2 : 1;
 
 			if (connected == 2) {
+				morphProcess(t, args.sampleTime);
+
 				// Read mode
 				if (params[MODE_PARAM].getValue() == 0.f) {
 					// RESET input
@@ -167,7 +301,7 @@ struct EightFaceModule : Module {
 								presetLoad(t, std::floor(rescale(inputs[SLOT_INPUT].getVoltage(), 0.f, 10.f, 0, presetCount)));
 								break;
 							case SLOTCVMODE_C4:
-								presetLoad(t, std::round(clamp(inputs[SLOT_INPUT].getVoltage() * 12.f, 0.f, NUM_PRESETS - 1.f)));
+								presetLoad(t, std::round(clamp(inputs[SLOT_INPUT].getVoltage() * 12.f, 0.f, presetTotal - 1.f)));
 								break;
 							case SLOTCVMODE_TRIG_FWD:
 								if (slotTrigger.process(inputs[SLOT_INPUT].getVoltage()))
@@ -205,9 +339,9 @@ struct EightFaceModule : Module {
 							case LongPressButton::NO_PRESS:
 								break;
 							case LongPressButton::SHORT_PRESS:
-								presetLoad(t, i, slotCvMode == SLOTCVMODE_ARM, true); break;
+								presetLoad(t, bank * NUM_PRESETS + i, slotCvMode == SLOTCVMODE_ARM, true); break;
 							case LongPressButton::LONG_PRESS:
-								presetSetCount(i + 1); break;
+								presetSetCount(bank * NUM_PRESETS + i + 1); break;
 						}
 					}
 				}
@@ -219,9 +353,9 @@ struct EightFaceModule : Module {
 							case LongPressButton::NO_PRESS:
 								break;
 							case LongPressButton::SHORT_PRESS:
-								presetSave(t, i); break;
+								presetSave(t, bank * NUM_PRESETS + i); break;
 							case LongPressButton::LONG_PRESS:
-								presetClear(i); break;
+								presetClear(bank * NUM_PRESETS + i); break;
 						}
 					}
 				}
@@ -251,13 +385,14 @@ struct EightFaceModule : Module {
 			}
 
 			for (int i = 0; i < NUM_PRESETS; i++) {
+				int j = bank * NUM_PRESETS + i;
 				if (params[MODE_PARAM].getValue() == 0.f) {
-					lights[PRESET_LIGHT + i * 3 + 0].setBrightness(presetNext == i ? 1.f : 0.f);
-					lights[PRESET_LIGHT + i * 3 + 1].setSmoothBrightness(preset != i && presetCount > i ? (presetSlotUsed[i] ? 1.f : 0.2f) : 0.f, s);
-					lights[PRESET_LIGHT + i * 3 + 2].setSmoothBrightness(preset == i ? 1.f : 0.f, s);
+					lights[PRESET_LIGHT + i * 3 + 0].setBrightness(presetNext == j ? 1.f : 0.f);
+					lights[PRESET_LIGHT + i * 3 + 1].setSmoothBrightness(preset != j && presetCount > j ? (presetSlotUsed[j] ? 1.f : 0.2f) : 0.f, s);
+					lights[PRESET_LIGHT + i * 3 + 2].setSmoothBrightness(preset == j ? 1.f : 0.f, s);
 				}
 				else {
-					lights[PRESET_LIGHT + i * 3 + 0].setBrightness(presetSlotUsed[i] ? 1.f : 0.f);
+					lights[PRESET_LIGHT + i * 3 + 0].setBrightness(presetSlotUsed[j] ? 1.f : 0.f);
 					lights[PRESET_LIGHT + i * 3 + 1].setBrightness(0.f);
 					lights[PRESET_LIGHT + i * 3 + 2].setBrightness(0.f);
 				}
@@ -267,12 +402,76 @@ struct EightFaceModule : Module {
 
 
 	void workerProcess() {
-		while (true) {
-			std::unique_lock<std::mutex> lock(workerMutex);
-			workerCondVar.wait(lock, std::bind(&EightFaceModule::workerDoProcess, this));
-			if (!workerIsRunning || workerPreset < 0) return;
-			workerModuleWidget->fromJson(presetSlot[workerPreset]);
-			workerDoProcess = false;
+		while (workerIsRunning) {
+			WorkerRequest* r = workerMailbox.fetch();
+			if (!r) {
+				// The engine thread never locks the mutex, so a notification might get lost
+				// between checking and waiting: do not wait forever
+				std::unique_lock<std::mutex> lock(workerMutex);
+				workerCondVar.wait_for(lock, std::chrono::milliseconds(20), [this]() { return !workerIsRunning || workerMailbox.pending(); });
+				continue;
+			}
+			for (WorkerLoad& l : r->load) {
+				json_t* moduleJ = moduleFromBlob(l.moduleBlob, l.dataBlob);
+				if (!moduleJ) continue;
+				l.mw->fromJson(moduleJ);
+				json_decref(moduleJ);
+			}
+			if (r->parse >= 0) {
+				PresetParams* d = new PresetParams;
+				d->generation = r->parseGeneration;
+				for (std::shared_ptr<std::string>& blob : r->parseBlob) {
+					json_error_t error;
+					json_t* moduleJ = json_loads(blob->c_str(), 0, &error);
+					// An unreadable blob still needs its entry to keep the modules aligned
+					presetExtractParams(*d, moduleJ);
+					if (moduleJ) json_decref(moduleJ);
+				}
+				// Values of an earlier request which have not been taken over yet are obsolete
+				delete presetSlot[r->parse].paramsNew.exchange(d);
+			}
+			r->clear();
+			workerDoneGeneration = r->generation;
+		}
+	}
+
+	/**
+	 * Hands the modules marked in loadData over to the worker, replacing any request not
+	 * started yet. Parameter values of slot p are parsed too if not done yet. Never blocks.
+	 * To be called from engine-thread only.
+	 */
+	void workerPost(int p) {
+		PresetSlot& slot = presetSlot[p];
+		WorkerRequest& r = workerMailbox.writeBuffer();
+		r.clear();
+		for (size_t k = 0; k < chain.size(); k++) {
+			if (!loadData[k] || chain[k]->model != slot.model[k]) continue;
+			ModuleWidget* mw = APP->scene->rack->getModule(chain[k]->id);
+			if (!mw) continue;
+			r.load.push_back(WorkerLoad{mw, slot.moduleBlob[k], slot.dataBlob[k]});
+		}
+		if (!slot.params) {
+			r.parse = p;
+			r.parseGeneration = slot.generation;
+			r.parseBlob = slot.moduleBlob;
+		}
+		r.generation = ++workerGeneration;
+		workerMailbox.publish();
+		// Drop a stale request which has been superseded before the worker picked it up
+		workerMailbox.writeBuffer().clear();
+		workerCondVar.notify_one();
+	}
+
+	/**
+	 * Collects up to n modules of the expander chain starting with module m.
+	 * To be called from engine-thread only.
+	 */
+	void chainCollect(Module* m, size_t n) {
+		chain.clear();
+		while (m && chain.size() < n) {
+			chain.push_back(m);
+			Expander* exp = mode == MODE_LEFT ? &m->leftExpander : &m->rightExpander;
+			m = exp->moduleId >= 0 ? exp->module : NULL;
 		}
 	}
 
@@ -282,15 +481,44 @@ struct EightFaceModule : Module {
 
 		if (!isNext) {
 			if (p != preset || force) {
+				PresetSlot& slot = presetSlot[p];
+				chainCollect(m, slot.moduleBlob.size());
+				presetAdopt(slot);
+				if (preset >= 0) presetAdopt(presetSlot[preset]);
+
+				// Switching between two slots on the same modules only needs the differences,
+				// a forced load (e.g. by button) always restores the complete preset
+				bool workerIdle = workerDoneGeneration == workerGeneration;
+				int from = -1;
+				if (!force && workerIdle && preset >= 0 && presetSlotUsed[preset] && presetSlotUsed[p] && presetSlot[preset].params && slot.params && presetAppliedMatches())
+					from = preset;
+
 				preset = p;
+				bank = p / NUM_PRESETS;
 				presetNext = -1;
 				if (!presetSlotUsed[p]) return;
-				ModuleWidget* mw = APP->scene->rack->getModule(m->id);
-				//mw->fromJson(presetSlot[p]);
-				workerModuleWidget = mw;
-				workerPreset = p;
-				workerDoProcess = true;
-				workerCondVar.notify_one();
+
+				// Module data can only be restored by the module itself
+				loadData.assign(chain.size(), false);
+				if (!workerIdle || !slot.params) {
+					// A pending or running load would overwrite any parameters set here,
+					// so the complete preset is left to the worker. The same applies to a slot
+					// used for the first time, which is parsed by the worker meanwhile
+					loadData.assign(chain.size(), true);
+				}
+				else {
+					for (size_t k = 0; k < chain.size(); k++)
+						loadData[k] = from >= 0 ? presetDataDiffers(from, p, k) : (bool)slot.dataBlob[k];
+				}
+
+				if (!slot.params || std::find(loadData.begin(), loadData.end(), true) != loadData.end())
+					workerPost(p);
+
+				morphStart(p, from);
+
+				presetAppliedIds.clear();
+				for (Module* c : chain)
+					presetAppliedIds.push_back(c->id);
 			}
 		}
 		else {
@@ -299,11 +527,14 @@ struct EightFaceModule : Module {
 		}
 	}
 
-	void presetSave(Module* m, int p) {
-		pluginSlug = m->model->plugin->name;
-		modelSlug = m->model->name;
-		moduleName = m->model->plugin->brand + " " + m->model->name;
+	bool presetAppliedMatches() {
+		if (presetAppliedIds.size() != chain.size()) return false;
+		for (size_t k = 0; k < chain.size(); k++)
+			if (presetAppliedIds[k] != chain[k]->id) return false;
+		return true;
+	}
 
+	void presetSave(Module* m, int p) {
 		// Do not handle some specific modules known to use mapping of parameters:
 		// Potential thread locking when multi-threading is enabled and parameter mappings
 		// are restored from preset.
@@ -313,21 +544,49 @@ struct EightFaceModule : Module {
 			return;
 		*/
 
-		ModuleWidget* mw = APP->scene->rack->getModule(m->id);
-		if (presetSlotUsed[p]) json_decref(presetSlot[p]);
-		presetSlotUsed[p] = true;
-		presetSlot[p] = mw->toJson();
+		chainCollect(m, chainMode ? std::numeric_limits<size_t>::max() : 1);
+		if (chainMode) {
+			pluginSlug = "";
+			modelSlug = "";
+			moduleName = string::f("Chain of %d modules", (int)chain.size());
+		}
+		else {
+			pluginSlug = m->model->plugin->name;
+			modelSlug = m->model->name;
+			moduleName = m->model->plugin->brand + " " + m->model->name;
+		}
+
+		presetSlotFree(p);
+		PresetSlot& slot = presetSlot[p];
+		// The snapshot is at hand, so the parameter values are extracted right away
+		slot.params = new PresetParams;
+		slot.params->generation = slot.generation;
+		for (Module* c : chain) {
+			ModuleWidget* mw = APP->scene->rack->getModule(c->id);
+			if (!mw) continue;
+			json_t* moduleJ = mw->toJson();
+			presetAddModule(slot, moduleJ);
+			presetExtractParams(*slot.params, moduleJ);
+			json_decref(moduleJ);
+		}
+		presetSlotUsed[p] = slot.moduleBlob.size() > 0;
+		presetReserve();
+
+		// The modules' state matches the saved slot but not necessarily the current one
+		presetAppliedIds.clear();
+		if (preset == p) {
+			for (Module* c : chain)
+				presetAppliedIds.push_back(c->id);
+		}
 	}
 
 	void presetClear(int p) {
-		if (presetSlotUsed[p]) 
-			json_decref(presetSlot[p]);
-		presetSlot[p] = NULL;
+		presetSlotFree(p);
 		presetSlotUsed[p] = false;
 		if (preset == p) 
 			preset = -1;
 		bool empty = true;
-		for (int i = 0; i < NUM_PRESETS; i++) 
+		for (int i = 0; i < MAX_PRESETS; i++) 
 			empty = empty && !presetSlotUsed[i];
 		if (empty) {
 			pluginSlug = "";
@@ -336,6 +595,221 @@ struct EightFaceModule : Module {
 		}
 	}
 
+	void presetSlotFree(int p) {
+		PresetSlot& slot = presetSlot[p];
+		slot.moduleBlob.clear();
+		slot.dataBlob.clear();
+		slot.model.clear();
+		slot.paramTotal = 0;
+		// Values parsed by the worker for the previous contents are dropped on takeover
+		slot.generation++;
+		delete slot.params;
+		slot.params = NULL;
+		delete slot.paramsNew.exchange(NULL);
+	}
+
+	/**
+	 * Takes over the parameter values parsed by the worker, unless the slot has been changed
+	 * in the meantime.
+	 * To be called from engine-thread only.
+	 */
+	void presetAdopt(PresetSlot& slot) {
+		PresetParams* d = slot.paramsNew.exchange(NULL);
+		if (!d) return;
+		if (d->generation == slot.generation && !slot.params)
+			slot.params = d;
+		else
+			delete d;
+	}
+
+	/**
+	 * Sizes the buffers used for switching presets to fit all used slots, so a switch never
+	 * allocates on the engine thread.
+	 */
+	void presetReserve() {
+		size_t modules = 0;
+		size_t params = 0;
+		for (int i = 0; i < MAX_PRESETS; i++) {
+			if (!presetSlotUsed[i]) continue;
+			modules = std::max(modules, presetSlot[i].moduleBlob.size());
+			params = std::max(params, presetSlot[i].paramTotal);
+		}
+		chain.reserve(modules);
+		loadData.reserve(modules);
+		presetAppliedIds.reserve(modules);
+		morphModuleIds.reserve(modules);
+		morph.reserve(params);
+	}
+
+	static std::shared_ptr<std::string> blobFromJson(json_t* j, size_t flags) {
+		char* s = json_dumps(j, flags);
+		std::shared_ptr<std::string> blob = std::make_shared<std::string>(s ? s : "");
+		free(s);
+		return blob;
+	}
+
+	/**
+	 * Restores a module's snapshot from its blobs, returns NULL if the blob can't be parsed.
+	 */
+	static json_t* moduleFromBlob(const std::shared_ptr<std::string>& moduleBlob, const std::shared_ptr<std::string>& dataBlob) {
+		json_t* moduleJ = json_loads(moduleBlob->c_str(), 0, NULL);
+		if (!moduleJ) return NULL;
+		if (dataBlob) {
+			json_t* dataJ = json_loads(dataBlob->c_str(), 0, NULL);
+			if (dataJ) json_object_update(moduleJ, dataJ);
+			json_decref(dataJ);
+		}
+		return moduleJ;
+	}
+
+	/**
+	 * Appends a module's snapshot to a slot, serialized for the worker. Only the information
+	 * needed for verifying the chain is extracted here, parameter values are parsed from the
+	 * blob when the slot is used for the first time.
+	 */
+	void presetAddModule(PresetSlot& slot, json_t* moduleJ) {
+		size_t k = slot.moduleBlob.size();
+		const char* pluginSlugC = json_string_value(json_object_get(moduleJ, "plugin"));
+		const char* modelSlugC = json_string_value(json_object_get(moduleJ, "model"));
+		slot.model.push_back(pluginSlugC && modelSlugC ? plugin::getModel(pluginSlugC, modelSlugC) : NULL);
+		slot.paramTotal += json_array_size(json_object_get(moduleJ, "params"));
+
+		// Data is stored separately in a canonical form for comparing it between slots
+		json_t* dataJ = json_object_get(moduleJ, "data");
+		json_t* bypassJ = json_object_get(moduleJ, "bypass");
+		std::shared_ptr<std::string> dataBlob;
+		if (dataJ || bypassJ) {
+			json_t* j = json_object();
+			if (dataJ) json_object_set(j, "data", dataJ);
+			if (bypassJ) json_object_set(j, "bypass", bypassJ);
+			dataBlob = blobFromJson(j, JSON_COMPACT | JSON_SORT_KEYS);
+			json_decref(j);
+			// Slots sharing the same data of a module, e.g. presets differing in parameters only,
+			// keep a single copy so they can be compared by pointer when switching
+			for (int i = 0; i < MAX_PRESETS; i++) {
+				PresetSlot& other = presetSlot[i];
+				if (&other == &slot || k >= other.dataBlob.size() || !other.dataBlob[k]) continue;
+				if (*other.dataBlob[k] == *dataBlob) {
+					dataBlob = other.dataBlob[k];
+					break;
+				}
+			}
+		}
+		slot.dataBlob.push_back(dataBlob);
+
+		// The original tree is not modified, it might be part of the patch
+		json_t* baseJ = json_copy(moduleJ);
+		json_object_del(baseJ, "data");
+		json_object_del(baseJ, "bypass");
+		slot.moduleBlob.push_back(blobFromJson(baseJ, JSON_COMPACT));
+		json_decref(baseJ);
+	}
+
+	/**
+	 * Extracts the parameter values of a module's snapshot into flat arrays, so the preset
+	 * can be applied on the engine thread without a full ModuleWidget::fromJson.
+	 */
+	static void presetExtractParams(PresetParams& d, json_t* moduleJ) {
+		d.paramOffset.push_back(d.params.size());
+
+		json_t* paramsJ = json_object_get(moduleJ, "params");
+		// Rack v1 stores every parameter of a module, so a valid id is always below the array size
+		size_t paramCount = json_array_size(paramsJ);
+		d.params.resize(d.paramOffset.back() + paramCount, NAN);
+		json_t* paramJ;
+		size_t paramIndex;
+		json_array_foreach(paramsJ, paramIndex, paramJ) {
+			json_t* idJ = json_object_get(paramJ, "id");
+			json_t* valueJ = json_object_get(paramJ, "value");
+			if (!valueJ) continue;
+			// Patches prior to Rack v1 store parameters by index
+			json_int_t id = idJ ? json_integer_value(idJ) : (json_int_t)paramIndex;
+			if (id < 0 || (size_t)id >= paramCount) continue;
+			d.params[d.paramOffset.back() + id] = json_number_value(valueJ);
+		}
+	}
+
+	/**
+	 * Returns true if module k of slot `to` has to be restored by the worker when switching
+	 * from slot `from`, modules not present at the same position of both slots are applied completely.
+	 */
+	bool presetDataDiffers(int from, int to, size_t k) {
+		PresetSlot& a = presetSlot[from];
+		PresetSlot& b = presetSlot[to];
+		bool same = k < a.model.size() && a.model[k] == b.model[k];
+		if (!same) return (bool)b.dataBlob[k];
+		// Equal data is shared between slots, comparing the contents covers blobs not deduplicated
+		if (a.dataBlob[k] == b.dataBlob[k]) return false;
+		if (!a.dataBlob[k] || !b.dataBlob[k]) return true;
+		return *a.dataBlob[k] != *b.dataBlob[k];
+	}
+
+	/**
+	 * Starts interpolating parameters of the collected chain towards the values of a slot,
+	 * limited to the parameters differing from slot `from` if given. Modules restored by the
+	 * worker are skipped.
+	 * To be called from engine-thread only.
+	 */
+	void morphStart(int p, int from = -1) {
+		PresetSlot& slot = presetSlot[p];
+		PresetParams* d = slot.params;
+		// A running morph has to be finished on all parameters
+		if (morphPhase < 1.f)
+			from = -1;
+		// Parameters of slot `from`, both slots have been parsed if given
+		PresetParams* a = from >= 0 ? presetSlot[from].params : NULL;
+
+		morph.clear();
+		for (size_t k = 0; k < chain.size(); k++) {
+			if (!d || loadData[k] || chain[k]->model != slot.model[k]) continue;
+			int n = std::min(d->paramCount(k), (int)chain[k]->params.size());
+			// Parameters of the same module within slot `from`
+			int m = a && k < presetSlot[from].model.size() && presetSlot[from].model[k] == slot.model[k] ? a->paramCount(k) : 0;
+			for (int i = 0; i < n; i++) {
+				float v = d->params[d->paramOffset[k] + i];
+				if (std::isnan(v)) continue;
+				if (i < m && a->params[a->paramOffset[k] + i] == v) continue;
+				morph.push_back(MorphParam{(int)k, i, chain[k]->params[i].getValue(), v});
+			}
+		}
+
+		morphModuleIds.clear();
+		for (Module* c : chain)
+			morphModuleIds.push_back(c->id);
+		morphPhase = 0.f;
+		morphApply(0.f);
+	}
+
+	/**
+	 * Advances a running morph, all modules of the chain are processed in a single pass.
+	 * To be called from engine-thread only.
+	 */
+	void morphProcess(Module* m, float sampleTime) {
+		if (morphPhase >= 1.f) return;
+		chainCollect(m, morphModuleIds.size());
+		if (chain.size() != morphModuleIds.size()) {
+			morphPhase = 1.f;
+			return;
+		}
+		for (size_t k = 0; k < chain.size(); k++) {
+			if (chain[k]->id != morphModuleIds[k]) {
+				morphPhase = 1.f;
+				return;
+			}
+		}
+		morphApply(sampleTime);
+	}
+
+	void morphApply(float sampleTime) {
+		morphPhase = morphTime > 0.f ? std::min(morphPhase + sampleTime / morphTime, 1.f) : 1.f;
+		for (MorphParam& mp : morph) {
+			Module* m = chain[mp.module];
+			// Switches and other snapping parameters jump to the target value immediately
+			float v = m->paramQuantities[mp.paramId]->snapEnabled ? mp.to : crossfade(mp.from, mp.to, morphPhase);
+			m->params[mp.paramId].setValue(v);
+		}
+	}
+
 	void presetSetCount(int p) {
 		if (preset >= p) preset = 0;
 		presetCount = p;
@@ -344,22 +818,49 @@ struct EightFaceModule : Module {
 		randDist = new std::uniform_int_distribution<int>(0, presetCount - 1);
 	}
 
+	void presetSetTotal(int n) {
+		presetTotal = n;
+		if (presetCount > n) presetSetCount(n);
+		if (bank * NUM_PRESETS >= n) bank = 0;
+	}
+
 	json_t* dataToJson() override {
 		json_t* rootJ = json_object();
 		json_object_set_new(rootJ, "mode", json_integer(mode));
+		json_object_set_new(rootJ, "chainMode", json_boolean(chainMode));
 		json_object_set_new(rootJ, "pluginSlug", json_string(pluginSlug.c_str()));
 		json_object_set_new(rootJ, "modelSlug", json_string(modelSlug.c_str()));
 		json_object_set_new(rootJ, "moduleName", json_string(moduleName.c_str()));
 		json_object_set_new(rootJ, "slotCvMode", json_integer(slotCvMode));
 		json_object_set_new(rootJ, "preset", json_integer(preset));
 		json_object_set_new(rootJ, "presetCount", json_integer(presetCount));
+		json_object_set_new(rootJ, "presetTotal", json_integer(presetTotal));
+		json_object_set_new(rootJ, "bank", json_integer(bank));
+		json_object_set_new(rootJ, "morphTime", json_real(morphTime));
+
+		// Slots beyond presetTotal are kept as long as they are in use
+		int n = presetTotal;
+		for (int i = presetTotal; i < MAX_PRESETS; i++)
+			if (presetSlotUsed[i]) n = i + 1;
 
 		json_t* presetsJ = json_array();
-		for (int i = 0; i < NUM_PRESETS; i++) {
+		for (int i = 0; i < n; i++) {
 			json_t* presetJ = json_object();
 			json_object_set_new(presetJ, "slotUsed", json_boolean(presetSlotUsed[i]));
 			if (presetSlotUsed[i]) {
-				json_object_set(presetJ, "slot", presetSlot[i]);
+				PresetSlot& slot = presetSlot[i];
+				if (slot.moduleBlob.size() == 1) {
+					json_t* moduleJ = moduleFromBlob(slot.moduleBlob[0], slot.dataBlob[0]);
+					if (moduleJ) json_object_set_new(presetJ, "slot", moduleJ);
+				}
+				else {
+					json_t* slotsJ = json_array();
+					for (size_t k = 0; k < slot.moduleBlob.size(); k++) {
+						json_t* moduleJ = moduleFromBlob(slot.moduleBlob[k], slot.dataBlob[k]);
+						json_array_append_new(slotsJ, moduleJ ? moduleJ : json_null());
+					}
+					json_object_set_new(presetJ, "slots", slotsJ);
+				}
 			}
 			json_array_append_new(presetsJ, presetJ);
 		}
@@ -370,6 +871,8 @@ struct EightFaceModule : Module {
 	void dataFromJson(json_t* rootJ) override {
 		json_t* modeJ = json_object_get(rootJ, "mode");
 		if (modeJ) mode = (MODE)json_integer_value(modeJ);
+		json_t* chainModeJ = json_object_get(rootJ, "chainMode");
+		if (chainModeJ) chainMode = json_boolean_value(chainModeJ);
 		pluginSlug = json_string_value(json_object_get(rootJ, "pluginSlug"));
 		modelSlug = json_string_value(json_object_get(rootJ, "modelSlug"));
 		json_t* moduleNameJ = json_object_get(rootJ, "moduleName");
@@ -377,14 +880,38 @@ struct EightFaceModule : Module {
 		slotCvMode = (SLOTCVMODE)json_integer_value(json_object_get(rootJ, "slotCvMode"));
 		preset = json_integer_value(json_object_get(rootJ, "preset"));
 		presetCount = json_integer_value(json_object_get(rootJ, "presetCount"));
+		json_t* presetTotalJ = json_object_get(rootJ, "presetTotal");
+		presetTotal = presetTotalJ ? clamp((int)json_integer_value(presetTotalJ), NUM_PRESETS, MAX_PRESETS) : NUM_PRESETS;
+		json_t* bankJ = json_object_get(rootJ, "bank");
+		bank = bankJ ? json_integer_value(bankJ) : 0;
+		if (bank * NUM_PRESETS >= presetTotal) bank = 0;
+		json_t* morphTimeJ = json_object_get(rootJ, "morphTime");
+		if (morphTimeJ) morphTime = json_real_value(morphTimeJ);
+
+		// Slots beyond the incoming array must not survive from the previous state
+		for (int i = 0; i < MAX_PRESETS; i++) {
+			presetSlotFree(i);
+			presetSlotUsed[i] = false;
+		}
 
 		json_t* presetsJ = json_object_get(rootJ, "presets");
 		json_t* presetJ;
 		size_t presetIndex;
 		json_array_foreach(presetsJ, presetIndex, presetJ) {
-			presetSlotUsed[presetIndex] = json_boolean_value(json_object_get(presetJ, "slotUsed"));
-			presetSlot[presetIndex] = json_deep_copy(json_object_get(presetJ, "slot"));
+			if (presetIndex >= MAX_PRESETS) break;
+			// Parameter values are parsed by the worker when a slot is used for the first time
+			json_t* slotJ = json_object_get(presetJ, "slot");
+			if (slotJ) presetAddModule(presetSlot[presetIndex], slotJ);
+			json_t* slotsJ = json_object_get(presetJ, "slots");
+			json_t* moduleJ;
+			size_t moduleIndex;
+			json_array_foreach(slotsJ, moduleIndex, moduleJ) {
+				presetAddModule(presetSlot[presetIndex], moduleJ);
+			}
+			presetSlotUsed[presetIndex] = json_boolean_value(json_object_get(presetJ, "slotUsed")) && presetSlot[presetIndex].moduleBlob.size() > 0;
 		}
+		presetAppliedIds.clear();
+		presetReserve();
 
 		if (preset >= presetCount) 
 			preset = 0;
@@ -423,12 +950,94 @@ struct SlovCvModeMenuItem : MenuItem {
 		menu->addChild(construct<SlotCvModeItem>(&MenuItem::text, "Trigger pingpong", &SlotCvModeItem::module, module, &SlotCvModeItem::slotCvMode, SLOTCVMODE_TRIG_PINGPONG));
 		menu->addChild(construct<SlotCvModeItem>(&MenuItem::text, "Trigger random", &SlotCvModeItem::module, module, &SlotCvModeItem::slotCvMode, SLOTCVMODE_TRIG_RANDOM));
 		menu->addChild(construct<SlotCvModeItem>(&MenuItem::text, "0..10V", &SlotCvModeItem::module, module, &SlotCvModeItem::slotCvMode, SLOTCVMODE_10V));
-		menu->addChild(construct<SlotCvModeItem>(&MenuItem::text, "C4-G4", &SlotCvModeItem::module, module, &SlotCvModeItem::slotCvMode, SLOTCVMODE_C4));
+		menu->addChild(construct<SlotCvModeItem>(&MenuItem::text, "V/Oct, C4 = slot 1", &SlotCvModeItem::module, module, &SlotCvModeItem::slotCvMode, SLOTCVMODE_C4));
 		menu->addChild(construct<SlotCvModeItem>(&MenuItem::text, "Arm", &SlotCvModeItem::module, module, &SlotCvModeItem::slotCvMode, SLOTCVMODE_ARM));
 		return menu;
 	}
 };
 
+struct MorphTimeMenuItem : MenuItem {
+	struct MorphTimeItem : MenuItem {
+		EightFaceModule* module;
+		float morphTime;
+
+		void onAction(const event::Action &e) override {
+			module->morphTime = morphTime;
+		}
+
+		void step() override {
+			rightText = module->morphTime == morphTime ? "✔" : "";
+			MenuItem::step();
+		}
+	};
+
+	EightFaceModule* module;
+	Menu* createChildMenu() override {
+		Menu* menu = new Menu;
+		menu->addChild(construct<MorphTimeItem>(&MenuItem::text, "Off", &MorphTimeItem::module, module, &MorphTimeItem::morphTime, 0.f));
+		menu->addChild(construct<MorphTimeItem>(&MenuItem::text, "10ms", &MorphTimeItem::module, module, &MorphTimeItem::morphTime, 0.01f));
+		menu->addChild(construct<MorphTimeItem>(&MenuItem::text, "50ms", &MorphTimeItem::module, module, &MorphTimeItem::morphTime, 0.05f));
+		menu->addChild(construct<MorphTimeItem>(&MenuItem::text, "100ms", &MorphTimeItem::module, module, &MorphTimeItem::morphTime, 0.1f));
+		menu->addChild(construct<MorphTimeItem>(&MenuItem::text, "250ms", &MorphTimeItem::module, module, &MorphTimeItem::morphTime, 0.25f));
+		menu->addChild(construct<MorphTimeItem>(&MenuItem::text, "500ms", &MorphTimeItem::module, module, &MorphTimeItem::morphTime, 0.5f));
+		menu->addChild(construct<MorphTimeItem>(&MenuItem::text, "1s", &MorphTimeItem::module, module, &MorphTimeItem::morphTime, 1.f));
+		menu->addChild(construct<MorphTimeItem>(&MenuItem::text, "2s", &MorphTimeItem::module, module, &MorphTimeItem::morphTime, 2.f));
+		menu->addChild(construct<MorphTimeItem>(&MenuItem::text, "5s", &MorphTimeItem::module, module, &MorphTimeItem::morphTime, 5.f));
+		return menu;
+	}
+};
+
+struct PresetTotalMenuItem : MenuItem {
+	struct PresetTotalItem : MenuItem {
+		EightFaceModule* module;
+		int presetTotal;
+
+		void onAction(const event::Action &e) override {
+			module->presetSetTotal(presetTotal);
+		}
+
+		void step() override {
+			rightText = module->presetTotal == presetTotal ? "✔" : "";
+			MenuItem::step();
+		}
+	};
+
+	EightFaceModule* module;
+	Menu* createChildMenu() override {
+		Menu* menu = new Menu;
+		for (int n = NUM_PRESETS; n <= MAX_PRESETS; n *= 2) {
+			menu->addChild(construct<PresetTotalItem>(&MenuItem::text, string::f("%d", n), &PresetTotalItem::module, module, &PresetTotalItem::presetTotal, n));
+		}
+		return menu;
+	}
+};
+
+struct BankMenuItem : MenuItem {
+	struct BankItem : MenuItem {
+		EightFaceModule* module;
+		int bank;
+
+		void onAction(const event::Action &e) override {
+			module->bank = bank;
+		}
+
+		void step() override {
+			rightText = module->bank == bank ? "✔" : "";
+			MenuItem::step();
+		}
+	};
+
+	EightFaceModule* module;
+	Menu* createChildMenu() override {
+		Menu* menu = new Menu;
+		for (int i = 0; i < module->presetTotal / NUM_PRESETS; i++) {
+			std::string text = string::f("Slots %d-%d", i * NUM_PRESETS + 1, (i + 1) * NUM_PRESETS);
+			menu->addChild(construct<BankItem>(&MenuItem::text, text, &BankItem::module, module, &BankItem::bank, i));
+		}
+		return menu;
+	}
+};
+
 struct AutoloadItem : MenuItem {
 	EightFaceModule* module;
 
@@ -456,6 +1065,19 @@ struct ModeItem : MenuItem {
 	}
 };
 
+struct ChainModeItem : MenuItem {
+	EightFaceModule* module;
+
+	void onAction(const event::Action &e) override {
+		module->chainMode ^= true;
+	}
+
+	void step() override {
+		rightText = module->chainMode ? "✔" : "";
+		MenuItem::step();
+	}
+};
+
 
 struct CKSSH : CKSS {
 	CKSSH() {
@@ -549,7 +1171,20 @@ struct EightFaceWidget : ModuleWidget {
 		slotCvModeMenuItem->rightText = RIGHT_ARROW;
 		menu->addChild(slotCvModeMenuItem);
 
+		PresetTotalMenuItem* presetTotalMenuItem = construct<PresetTotalMenuItem>(&MenuItem::text, "Number of slots", &PresetTotalMenuItem::module, module);
+		presetTotalMenuItem->rightText = RIGHT_ARROW;
+		menu->addChild(presetTotalMenuItem);
+
+		BankMenuItem* bankMenuItem = construct<BankMenuItem>(&MenuItem::text, "Bank", &BankMenuItem::module, module);
+		bankMenuItem->rightText = RIGHT_ARROW;
+		menu->addChild(bankMenuItem);
+
+		MorphTimeMenuItem* morphTimeMenuItem = construct<MorphTimeMenuItem>(&MenuItem::text, "Morph time", &MorphTimeMenuItem::module, module);
+		morphTimeMenuItem->rightText = RIGHT_ARROW;
+		menu->addChild(morphTimeMenuItem);
+
 		menu->addChild(construct<ModeItem>(&MenuItem::text, "Module", &ModeItem::module, module));
+		menu->addChild(construct<ChainModeItem>(&MenuItem::text, "Capture expander chain", &ChainModeItem::module, module));
 
 		menu->addChild(construct<AutoloadItem>(&MenuItem::text, "Autoload first preset", &AutoloadItem::module, module));
 	}
@@ -557,4 +1192,4 @@ struct EightFaceWidget : ModuleWidget {
 
 } // namespace EightFace
 
-Model* modelEightFace = createModel<EightFace::EightFaceModule, EightFace::EightFaceWidget>("EightFace");
\ No newline at end of file
+Model* modelEightFace = createModelProfiled<EightFace::EightFaceModule, EightFace::EightFaceWidget>("EightFace");
\ No newline at end of file
@@ -2,30 +2,256 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <sys/stat.h>
 #include <patch.hpp>
 #include <osdialog.h>
 
 
 namespace Exit {
 
-static std::string path;
-static int workToDo;
+/**
+ * Cache of parsed patch files shared by all EXIT modules. Loading a patch destroys the
+ * module which triggered it, so the cache lives outside the modules. A watcher thread reads
+ * and parses every referenced file in the background and parses it again when the file
+ * changes on disk, a trigger only has to swap in the parsed tree.
+ */
+namespace Cache {
 
-void exit_worker() {
-	if (workToDo == 2)
+struct Entry {
+	/** Number of modules referencing the file */
+	int users = 0;
+	json_t* rootJ = NULL;
+	time_t mtime = 0;
+};
+
+static const int WATCH_INTERVAL = 500;
+
+static std::mutex mutex;
+static std::condition_variable condVar;
+static std::map<std::string, Entry> entries;
+static std::thread* watcher = NULL;
+/** Incremented for stopping the running watcher */
+static int watcherGeneration = 0;
+
+static time_t modifiedTime(const std::string& path) {
+	struct stat s;
+	if (stat(path.c_str(), &s) != 0) return 0;
+	return s.st_mtime;
+}
+
+static void watch(int generation) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (generation == watcherGeneration) {
+		std::vector<std::pair<std::string, time_t>> check;
+		for (auto& it : entries) {
+			check.push_back(std::make_pair(it.first, it.second.mtime));
+		}
+
+		// Disk access and parsing happen outside of the lock
+		lock.unlock();
+		for (auto& c : check) {
+			time_t mtime = modifiedTime(c.first);
+			if (mtime == 0 || mtime == c.second) continue;
+			json_error_t error;
+			json_t* rootJ = json_load_file(c.first.c_str(), 0, &error);
+			// A file which is still being written fails to parse and is tried again later
+			if (!rootJ) continue;
+
+			lock.lock();
+			auto it = entries.find(c.first);
+			if (it != entries.end()) {
+				std::swap(it->second.rootJ, rootJ);
+				it->second.mtime = mtime;
+			}
+			lock.unlock();
+			if (rootJ) json_decref(rootJ);
+			INFO("EXIT cached patch %s", c.first.c_str());
+		}
+		lock.lock();
+
+		condVar.wait_for(lock, std::chrono::milliseconds(WATCH_INTERVAL));
+	}
+}
+
+/** Starts caching the file `path` */
+static void acquire(const std::string& path) {
+	if (path.empty()) return;
+	std::lock_guard<std::mutex> lock(mutex);
+	entries[path].users++;
+	if (!watcher) {
+		watcher = new std::thread(watch, watcherGeneration);
+	}
+	condVar.notify_one();
+}
+
+/** Stops caching the file `path`, the watcher thread stops when no files are left */
+static void release(const std::string& path) {
+	if (path.empty()) return;
+	std::thread* t = NULL;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = entries.find(path);
+		if (it == entries.end()) return;
+		if (--it->second.users > 0) return;
+		if (it->second.rootJ) json_decref(it->second.rootJ);
+		entries.erase(it);
+		if (entries.empty() && watcher) {
+			watcherGeneration++;
+			std::swap(t, watcher);
+		}
+	}
+	if (t) {
+		condVar.notify_all();
+		t->join();
+		delete t;
+	}
+}
+
+/** Returns a new reference to the parsed tree of `path` or NULL if it is not available yet */
+static json_t* get(const std::string& path) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = entries.find(path);
+	if (it == entries.end() || !it->second.rootJ) return NULL;
+	return json_incref(it->second.rootJ);
+}
+
+static bool isCached(const std::string& path) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = entries.find(path);
+	return it != entries.end() && it->second.rootJ;
+}
+
+} // namespace Cache
+
+
+/**
+ * Single worker shared by all EXIT modules which performs the patch switches. It outlives the
+ * modules as the module posting a request gets destroyed by the load. Only one load is in
+ * flight at any time, triggers arriving while busy are coalesced.
+ */
+namespace Worker {
+
+struct Request {
+	std::string path;
+	bool save;
+};
+
+static std::mutex mutex;
+static std::condition_variable condVar;
+static std::thread* thread = NULL;
+/** Number of modules using the worker */
+static int users = 0;
+/** Incremented for stopping the running worker */
+static int generation = 0;
+static bool pending = false;
+static Request request;
+
+static std::atomic<bool> busy{false};
+/** Triggers dropped as a load was already pending or in flight */
+static std::atomic<int> coalesced{0};
+static std::atomic<int> loads{0};
+static std::atomic<float> lastSaveMs{0.f};
+static std::atomic<float> lastLoadMs{0.f};
+static std::atomic<bool> lastCached{false};
+
+static float msSince(std::chrono::steady_clock::time_point t) {
+	return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - t).count();
+}
+
+static void process(const Request& r) {
+	auto t0 = std::chrono::steady_clock::now();
+	if (r.save)
 		APP->patch->save(APP->patch->path);
-	APP->patch->load(path);
-	APP->patch->path = path;
+	lastSaveMs = r.save ? msSince(t0) : 0.f;
+
+	auto t1 = std::chrono::steady_clock::now();
+	json_t* rootJ = Cache::get(r.path);
+	if (rootJ) {
+		// Loading might modify the tree (e.g. for legacy patches), keep the cached one untouched
+		json_t* patchJ = json_deep_copy(rootJ);
+		json_decref(rootJ);
+		APP->patch->clear();
+		APP->patch->fromJson(patchJ);
+		json_decref(patchJ);
+	}
+	else {
+		APP->patch->load(r.path);
+	}
+	APP->patch->path = r.path;
 	APP->history->setSaved();
+
+	lastLoadMs = msSince(t1);
+	lastCached = rootJ != NULL;
+	loads++;
+	INFO("EXIT loaded patch %s in %.1f ms (%s), saving took %.1f ms", r.path.c_str(), lastLoadMs.load(), rootJ ? "cached" : "from disk", lastSaveMs.load());
+}
+
+static void run(int gen) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		condVar.wait(lock, [gen]() { return pending || gen != generation; });
+		if (gen != generation) break;
+		Request r = request;
+		pending = false;
+		busy = true;
+		lock.unlock();
+		process(r);
+		lock.lock();
+		busy = false;
+	}
 }
 
-void exit_run(std::string path, int workToDo) {
-	Exit::path = path;
-	Exit::workToDo = workToDo;
-	std::thread t(exit_worker);
-	t.detach();
+static void acquire() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (users++ == 0 && !thread) {
+		thread = new std::thread(run, generation);
+	}
 }
 
+static void release() {
+	std::thread* t = NULL;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--users > 0) return;
+		generation++;
+		std::swap(t, thread);
+	}
+	condVar.notify_all();
+	if (!t) return;
+	if (t->get_id() == std::this_thread::get_id()) {
+		// Released by a module destroyed during a load: the worker finishes the load and quits
+		t->detach();
+	}
+	else {
+		t->join();
+	}
+	delete t;
+}
+
+/**
+ * Posts a request from the engine thread without blocking. Returns false if the mailbox is
+ * locked at the moment, the caller should try again later.
+ */
+static bool post(const std::string& path, bool save) {
+	if (busy) {
+		coalesced++;
+		return true;
+	}
+	std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+	if (!lock.owns_lock()) return false;
+	if (pending) coalesced++;
+	request.path = path;
+	request.save = save;
+	pending = true;
+	condVar.notify_one();
+	return true;
+}
+
+} // namespace Worker
+
+
 static const char PATCH_FILTERS[] = "VCV Rack patch (.vcv):vcv";
 
 struct ExitModule : Module {
@@ -35,6 +261,7 @@ struct ExitModule : Module {
 	enum InputIds {
 		TRIG_INPUT,
 		TRIGS_INPUT,
+		SELECT_INPUT,
 		NUM_INPUTS
 	};
 	enum OutputIds {
@@ -44,46 +271,130 @@ struct ExitModule : Module {
 		NUM_LIGHTS
 	};
 
-	std::string path;
+	/** Minimum time between two accepted triggers in seconds */
+	const float DEBOUNCE = 0.1f;
+
+	/** [Stored to JSON] list of target patches, changed by the UI thread while holding pathsMutex */
+	std::vector<std::string> paths;
+	/** Guards paths against the engine thread, which only tries to lock it */
+	std::mutex pathsMutex;
+	/** Size of paths for checking triggers without locking */
+	std::atomic<int> pathsCount{0};
 
-	std::thread* worker;
-    std::mutex workerMutex;
-	std::condition_variable workerCondVar;
+	/** Request waiting to be posted to the worker: 0 none, 1 load, 2 save and load */
 	int workToDo = 0;
+	float debounceTime = 0.f;
 
 	dsp::SchmittTrigger trigTrigger;
 	dsp::SchmittTrigger trigsTrigger;
 
 	ExitModule() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+		Worker::acquire();
+	}
+
+	~ExitModule() {
+		for (std::string& p : paths) {
+			Cache::release(p);
+		}
+		Worker::release();
+	}
+
+	void onReset() override {
+		std::lock_guard<std::mutex> lock(pathsMutex);
+		for (std::string& p : paths) {
+			Cache::release(p);
+		}
+		paths.clear();
+		pathsCount = 0;
+	}
+
+	/** Returns the target selected by SEL input, 0..10V spans all targets */
+	int getSelected() {
+		int n = paths.size();
+		if (!inputs[SELECT_INPUT].isConnected()) return 0;
+		return clamp((int)std::floor(rescale(inputs[SELECT_INPUT].getVoltage(), 0.f, 10.f, 0, n)), 0, n - 1);
 	}
 
 	void process(const ProcessArgs &args) override {
-        if (inputs[TRIG_INPUT].isConnected() && trigTrigger.process(inputs[TRIG_INPUT].getVoltage())) {
-            workToDo = 1;
-			exit_run(path, 1);
-            //workerCondVar.notify_one();
-        }
-        if (inputs[TRIGS_INPUT].isConnected() && trigTrigger.process(inputs[TRIGS_INPUT].getVoltage())) {
-            workToDo = 2;
-			exit_run(path, 2);
-            //workerCondVar.notify_one();
-        }
+		if (debounceTime > 0.f) debounceTime -= args.sampleTime;
+
+		int trig = 0;
+		if (inputs[TRIG_INPUT].isConnected() && trigTrigger.process(inputs[TRIG_INPUT].getVoltage()))
+			trig = 1;
+		if (inputs[TRIGS_INPUT].isConnected() && trigsTrigger.process(inputs[TRIGS_INPUT].getVoltage()))
+			trig = 2;
+
+		if (trig > 0 && pathsCount > 0) {
+			if (debounceTime > 0.f) {
+				Worker::coalesced++;
+			}
+			else {
+				// Saving wins over a plain load if both are requested
+				workToDo = std::max(workToDo, trig);
+				debounceTime = DEBOUNCE;
+			}
+		}
+
+		if (workToDo > 0) {
+			// Never block the engine thread, a pending request is retried on the next sample
+			std::unique_lock<std::mutex> lock(pathsMutex, std::try_to_lock);
+			if (lock.owns_lock()) {
+				// All targets might have been removed meanwhile
+				if (paths.empty() || Worker::post(paths[getSelected()], workToDo == 2)) {
+					workToDo = 0;
+				}
+			}
+		}
+	}
+
+	void addPath(std::string path) {
+		Cache::acquire(path);
+		std::lock_guard<std::mutex> lock(pathsMutex);
+		paths.push_back(path);
+		pathsCount = paths.size();
+	}
+
+	void setPath(int i, std::string path) {
+		Cache::acquire(path);
+		std::lock_guard<std::mutex> lock(pathsMutex);
+		Cache::release(paths[i]);
+		paths[i] = path;
+	}
+
+	void removePath(int i) {
+		std::lock_guard<std::mutex> lock(pathsMutex);
+		Cache::release(paths[i]);
+		paths.erase(paths.begin() + i);
+		pathsCount = paths.size();
 	}
 
 	json_t* dataToJson() override {
 		json_t* rootJ = json_object();
 
-        json_t* pathJ = json_string(path.c_str());
-        json_object_set_new(rootJ, "path", pathJ);
+		json_t* pathsJ = json_array();
+		for (std::string& p : paths) {
+			json_array_append_new(pathsJ, json_string(p.c_str()));
+		}
+		json_object_set_new(rootJ, "paths", pathsJ);
         return rootJ;
 	}
 
 	void dataFromJson(json_t *rootJ) override {
-        json_t* pathJ = json_object_get(rootJ, "path");
-        if (pathJ)
-            path = json_string_value(pathJ);
-        }
+		onReset();
+		json_t* pathsJ = json_object_get(rootJ, "paths");
+		if (pathsJ) {
+			size_t i;
+			json_t* pathJ;
+			json_array_foreach(pathsJ, i, pathJ) {
+				if (json_is_string(pathJ)) addPath(json_string_value(pathJ));
+			}
+		}
+		// Single target of earlier versions
+		json_t* pathJ = json_object_get(rootJ, "path");
+		if (json_is_string(pathJ))
+			addPath(json_string_value(pathJ));
+	}
 };
 
 
@@ -98,18 +409,20 @@ struct ExitWidget : ModuleWidget {
 		addChild(createWidget<StoermelderBlackScrew>(Vec(RACK_GRID_WIDTH, 0)));
 		addChild(createWidget<StoermelderBlackScrew>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
 
+		addInput(createInputCentered<StoermelderPort>(Vec(22.5f, 236.7f), module, ExitModule::SELECT_INPUT));
 		addInput(createInputCentered<StoermelderPort>(Vec(22.5f, 280.2f), module, ExitModule::TRIG_INPUT));
 		addInput(createInputCentered<StoermelderPort>(Vec(22.5f, 323.7f), module, ExitModule::TRIGS_INPUT));
 	}
 
-	void selectFileDialog() {
+	/** Opens a file dialog for target `i`, a new target is added if `i` is out of range */
+	void selectFileDialog(int i) {
         std::string dir;
-        if (module->path.empty()) {
+        if (module->paths.empty()) {
             dir = asset::user("patches");
             system::createDirectory(dir);
         }
         else {
-            dir = string::directory(module->path);
+            dir = string::directory(module->paths.back());
         }
 
         osdialog_filters* filters = osdialog_filters_parse(PATCH_FILTERS);
@@ -126,7 +439,10 @@ struct ExitWidget : ModuleWidget {
             std::free(pathC);
         });
 
-        module->path = pathC;
+		if (i < (int)module->paths.size())
+			module->setPath(i, pathC);
+		else
+			module->addPath(pathC);
 	}
 
 	void appendContextMenu(Menu* menu) override {
@@ -134,25 +450,57 @@ struct ExitWidget : ModuleWidget {
 
 		struct SelectFileItem : MenuItem {
 			ExitWidget* widget;
+			int i;
+			void onAction(const event::Action &e) override {
+                widget->selectFileDialog(i);
+			}
+		};
+
+		struct RemoveItem : MenuItem {
+			ExitModule* module;
+			int i;
 			void onAction(const event::Action &e) override {
-                widget->selectFileDialog();
+				module->removePath(i);
+			}
+		};
+
+		struct TargetItem : MenuItem {
+			ExitWidget* widget;
+			int i;
+			Menu* createChildMenu() override {
+				Menu* menu = new Menu;
+				menu->addChild(construct<MenuLabel>(&MenuLabel::text, widget->module->paths[i]));
+				menu->addChild(construct<SelectFileItem>(&MenuItem::text, "Replace patch", &SelectFileItem::widget, widget, &SelectFileItem::i, i));
+				menu->addChild(construct<RemoveItem>(&MenuItem::text, "Remove", &RemoveItem::module, widget->module, &RemoveItem::i, i));
+				return menu;
 			}
 		};
 
-		menu->addChild(construct<SelectFileItem>(&MenuItem::text, "Select patch", &SelectFileItem::widget, this));
+		menu->addChild(construct<SelectFileItem>(&MenuItem::text, "Add patch", &SelectFileItem::widget, this, &SelectFileItem::i, module->paths.size()));
 
-		if (module->path != "") {
-			ui::MenuLabel* textLabel = new ui::MenuLabel;
-			textLabel->text = "Currently selected...";
-			menu->addChild(textLabel);
+		if (module->paths.size() > 0) {
+			menu->addChild(new MenuSeparator());
+			menu->addChild(construct<MenuLabel>(&MenuLabel::text, "Targets"));
+			int selected = module->getSelected();
+			for (size_t i = 0; i < module->paths.size(); i++) {
+				std::string text = string::f("%i: %s", (int)i + 1, string::filename(module->paths[i]).c_str());
+				std::string rightText = Cache::isCached(module->paths[i]) ? "" : "loading ";
+				if ((int)i == selected) rightText += "✔ ";
+				rightText += RIGHT_ARROW;
+				menu->addChild(construct<TargetItem>(&MenuItem::text, text, &MenuItem::rightText, rightText, &TargetItem::widget, this, &TargetItem::i, i));
+			}
+		}
 
-			ui::MenuLabel* modelLabel = new ui::MenuLabel;
-			modelLabel->text = module->path;
-			menu->addChild(modelLabel);
+		menu->addChild(new MenuSeparator());
+		if (Worker::loads > 0) {
+			menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Last load %.1f ms (%s)", Worker::lastLoadMs.load(), Worker::lastCached ? "cached" : "from disk")));
+			if (Worker::lastSaveMs > 0.f)
+				menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Last save %.1f ms", Worker::lastSaveMs.load())));
 		}
+		menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Coalesced triggers %i", Worker::coalesced.load())));
 	}
 };
 
 } // namespace Exit
 
-Model* modelExit = createModel<Exit::ExitModule, Exit::ExitWidget>("Exit");
\ No newline at end of file
+Model* modelExit = createModelProfiled<Exit::ExitModule, Exit::ExitWidget>("Exit");
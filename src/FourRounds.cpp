@@ -1,5 +1,6 @@
 #include "plugin.hpp"
-#include <random>
+#include "prng.hpp"
+#include "packed.hpp"
 #include <thread>
 
 namespace FourRounds {
@@ -36,19 +37,27 @@ struct FourRoundsModule : Module {
 
 	const static int SIZE = 8 + 4 + 2 + 1;
 
-	std::default_random_engine randGen{(uint16_t)std::chrono::system_clock::now().time_since_epoch().count()};
-	std::uniform_int_distribution<int> randDist = std::uniform_int_distribution<int>(0, 1);
-	std::uniform_real_distribution<float> randFloatDist = std::uniform_real_distribution<float>(0, 1);
-
-	/** [Stored to JSON] */
-	float state[SIZE];
 	/** [Stored to JSON] */
-	float lastValue[16];
+	Prng prng;
+
+	/** [Stored to JSON] state of every match for each polyphonic channel */
+	float state[PORT_MAX_CHANNELS][SIZE];
+	/** [Stored to JSON] sampled value of every input, 4 channels per float_4 */
+	simd::float_4 lastValue[16][PORT_MAX_CHANNELS / 4];
 	/** [Stored to JSON] */
 	MODE mode = MODE::DIRECT;
 	/** [Stored to JSON] */
 	bool inverted = false;
 
+	// Selection masks and weights of every match, derived from state, mode and inverted
+	simd::float_4 stateSelect[SIZE][PORT_MAX_CHANNELS / 4];
+	simd::float_4 stateWeight[SIZE][PORT_MAX_CHANNELS / 4];
+	bool stateDirty = true;
+	MODE lastMode = MODE::DIRECT;
+
+	// Inputs followed by the result of every match, match j reads nodes 2j and 2j+1
+	simd::float_4 node[16 + SIZE][PORT_MAX_CHANNELS / 4];
+
 	dsp::SchmittTrigger trigTrigger;
 	dsp::SchmittTrigger invTrigger;
 	dsp::ClockDivider lightDivider;
@@ -58,79 +67,119 @@ struct FourRoundsModule : Module {
 		configParam(TRIG_PARAM, 0.0f, 1.0f, 0.0f, "Trigger next contest");
 		configParam(INV_PARAM, 0.0f, 1.0f, 0.0f, "Invert current state");
 		lightDivider.setDivision(1024);
+		prng.setSeed(random::u64());
 		onReset();
 	}
 
 	void onReset() override {
-		for (int i = 0; i < SIZE; i++)
-			state[i] = randDist(randGen);
+		for (int c = 0; c < PORT_MAX_CHANNELS; c++)
+			for (int i = 0; i < SIZE; i++)
+				state[c][i] = prng.uniform() >= 0.5f;
 		for (int i = 0; i < 16; i++)
-			lastValue[i] = 0.f;
+			for (int k = 0; k < PORT_MAX_CHANNELS / 4; k++)
+				lastValue[i][k] = 0.f;
 		mode = MODE::DIRECT;
 		inverted = false;
+		stateDirty = true;
 	}
 
 	void process(const ProcessArgs &args) override {
+		// Each channel of the input ports takes part in its own contest
+		int channels = 1;
+		for (int i = 0; i < 16; i++) {
+			channels = std::max(channels, inputs[ROUND1_INPUT + i].getChannels());
+		}
+		int n = (channels + 3) / 4;
+
 		if (trigTrigger.process(inputs[TRIG_INPUT].getVoltage() + params[TRIG_PARAM].getValue())) {
 			switch (mode) {
 				case MODE::DIRECT:
 				case MODE::SH:
-					for (int i = 0; i < SIZE; i++) {
-						state[i] = randDist(randGen);
+					for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
+						for (int i = 0; i < SIZE; i++) {
+							state[c][i] = prng.uniform() >= 0.5f;
+						}
 					}
 					break;
 				case MODE::QUANTUM:
-					for (int i = 0; i < SIZE; i++) {
-						state[i] = randFloatDist(randGen);
+					for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
+						for (int i = 0; i < SIZE; i++) {
+							state[c][i] = prng.uniform();
+						}
 					}
 					break;
 			}
 			for (int i = 0; i < 16; i++) {
-				lastValue[i] = inputs[ROUND1_INPUT + i].getVoltage();
+				for (int k = 0; k < PORT_MAX_CHANNELS / 4; k++) {
+					lastValue[i][k] = getInputVoltage(i, k);
+				}
 			}
+			stateDirty = true;
 		}
 
 		if (invTrigger.process(inputs[INV_INPUT].getVoltage() + params[INV_PARAM].getValue())) {
 			inverted ^= true;
+			stateDirty = true;
 		}
 
-		for (int i = 0; i < 8; i++) {
-			float v = getInputVoltage(i);
-			outputs[ROUND2_OUTPUT + i].setVoltage(v);
-		}
-		for (int i = 0; i < 4; i++) {
-			float v = getOutputVoltage(8, ROUND2_OUTPUT, i);
-			outputs[ROUND3_OUTPUT + i].setVoltage(v);
+		if (stateDirty || mode != lastMode) {
+			updateState();
 		}
-		for (int i = 0; i < 2; i++) {
-			float v = getOutputVoltage(8 + 4, ROUND3_OUTPUT, i);
-			outputs[ROUND4_OUTPUT + i].setVoltage(v);
+
+		for (int i = 0; i < 16; i++) {
+			for (int k = 0; k < n; k++) {
+				node[i][k] = mode == MODE::SH ? lastValue[i][k] : getInputVoltage(i, k);
+			}
 		}
 
-		float v = getOutputVoltage(SIZE - 1, ROUND4_OUTPUT, 0);
-		outputs[WINNER_OUTPUT].setVoltage(v);
+		// All rounds of the contest as reduction over the nodes
+		for (int j = 0; j < SIZE; j++) {
+			simd::float_4* a = node[2 * j];
+			simd::float_4* b = node[2 * j + 1];
+			simd::float_4* r = node[16 + j];
+			if (mode == MODE::QUANTUM) {
+				for (int k = 0; k < n; k++) {
+					r[k] = a[k] * (1.f - stateWeight[j][k]) + b[k] * stateWeight[j][k];
+				}
+			}
+			else {
+				for (int k = 0; k < n; k++) {
+					r[k] = simd::ifelse(stateSelect[j][k], b[k], a[k]);
+				}
+			}
 
+			// Outputs of all rounds are enumerated in the same order as the matches
+			Output& output = outputs[ROUND2_OUTPUT + j];
+			output.setChannels(channels);
+			for (int k = 0; k < n; k++) {
+				r[k].store(output.getVoltages(4 * k));
+			}
+		}
+
+		// Lights show the contest of the first channel
 		if (lightDivider.process()) {
 			switch (mode) {
 				case MODE::DIRECT:
 				case MODE::SH: {
 					for (int i = 0; i < SIZE; i++) {
-						lights[ROUND_LIGHT + i * 6 + 0].setBrightness(inverted ? state[i] == 1.f : 0.f);
-						lights[ROUND_LIGHT + i * 6 + 1].setBrightness(inverted ? 0.f : state[i] == 0.f);
+						float s = state[0][i];
+						lights[ROUND_LIGHT + i * 6 + 0].setBrightness(inverted ? s == 1.f : 0.f);
+						lights[ROUND_LIGHT + i * 6 + 1].setBrightness(inverted ? 0.f : s == 0.f);
 						lights[ROUND_LIGHT + i * 6 + 2].setBrightness(0.f);
-						lights[ROUND_LIGHT + i * 6 + 3].setBrightness(inverted ? state[i] == 0.f : 0.f);
-						lights[ROUND_LIGHT + i * 6 + 4].setBrightness(inverted ? 0.f : state[i] == 1.f);
+						lights[ROUND_LIGHT + i * 6 + 3].setBrightness(inverted ? s == 0.f : 0.f);
+						lights[ROUND_LIGHT + i * 6 + 4].setBrightness(inverted ? 0.f : s == 1.f);
 						lights[ROUND_LIGHT + i * 6 + 5].setBrightness(0.f);
 					}
 					break;
 				}
 				case MODE::QUANTUM: {
 					for (int i = 0; i < SIZE; i++) {
-						float l1 = inverted ? state[i] : (1.f - state[i]);
+						float s = state[0][i];
+						float l1 = inverted ? s : (1.f - s);
 						lights[ROUND_LIGHT + i * 6 + 0].setBrightness(l1);
 						lights[ROUND_LIGHT + i * 6 + 1].setBrightness(l1);
 						lights[ROUND_LIGHT + i * 6 + 2].setBrightness(l1);
-						float l2 = inverted ? (1.f - state[i]) : state[i];
+						float l2 = inverted ? (1.f - s) : s;
 						lights[ROUND_LIGHT + i * 6 + 3].setBrightness(l2);
 						lights[ROUND_LIGHT + i * 6 + 4].setBrightness(l2);
 						lights[ROUND_LIGHT + i * 6 + 5].setBrightness(l2);
@@ -141,52 +190,33 @@ struct FourRoundsModule : Module {
 		}
 	}
 
-	inline float getInputVoltage(int index) {
-		switch (mode) {
-			case MODE::DIRECT: {
-				int s = (int(state[index]) + inverted) % 2;
-				return inputs[ROUND1_INPUT + index * 2 + s].getVoltage();
-			}
-			case MODE::SH: {
-				int s = (int(state[index]) + inverted) % 2;
-				return lastValue[index * 2 + s];
-			}
-			case MODE::QUANTUM: {
-				float v1 = inputs[ROUND1_INPUT + index * 2 + 0].getVoltage();
-				float v2 = inputs[ROUND1_INPUT + index * 2 + 1].getVoltage();
-				return !inverted ? (v1 * (1.f - state[index]) + v2 * state[index]) : (v1 * state[index] + v2 * (1.f - state[index]));
-			}
-			default: {
-				return 0.f;
-			}
-		}
+	/** Returns channels 4k to 4k+3 of input `i`, monophonic inputs are used for all channels */
+	inline simd::float_4 getInputVoltage(int i, int k) {
+		Input& input = inputs[ROUND1_INPUT + i];
+		if (input.getChannels() == 1) return simd::float_4(input.getVoltage());
+		return simd::float_4::load(input.getVoltages(4 * k));
 	}
 
-	inline float getOutputVoltage(int state_offset, int output_offset, int index) {
-		switch (mode) {
-			case MODE::DIRECT:
-			case MODE::SH: {
-				int s = (int(state[state_offset + index]) + inverted) % 2;
-				return outputs[output_offset + index * 2 + s].getVoltage();
-			}
-			case MODE::QUANTUM: {
-				float v1 = outputs[output_offset + index * 2 + 0].getVoltage();
-				float v2 = outputs[output_offset + index * 2 + 1].getVoltage();
-				int i = state_offset + index;
-				return !inverted ? (v1 * (1.f - state[i]) + v2 * state[i]) : (v1 * state[i] + v2 * (1.f - state[i]));
-			}
-			default: {
-				return 0.f;
+	/** Refreshes the selection masks and weights of all matches */
+	void updateState() {
+		for (int j = 0; j < SIZE; j++) {
+			for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
+				float w = inverted ? (1.f - state[c][j]) : state[c][j];
+				stateWeight[j][c / 4].s[c % 4] = w;
+				stateSelect[j][c / 4].s[c % 4] = w >= 0.5f ? simd::float_4::mask().s[0] : 0.f;
 			}
 		}
+		stateDirty = false;
+		lastMode = mode;
 	}
 
 	json_t* dataToJson() override {
 		json_t* rootJ = json_object();
+		// "state" and "lastValue" hold the first channel as in previous versions
 		json_t* statesJ = json_array();
 		for (int i = 0; i < SIZE; i++) {
 			json_t* stateJ = json_object();
-			json_object_set_new(stateJ, "value", json_real(state[i]));
+			json_object_set_new(stateJ, "value", json_real(state[0][i]));
 			json_array_append_new(statesJ, stateJ);
 		}
 		json_object_set_new(rootJ, "state", statesJ);
@@ -194,35 +224,66 @@ struct FourRoundsModule : Module {
 		json_t* lastValuesJ = json_array();
 		for (int i = 0; i < 16; i++) {
 			json_t* lastValueJ = json_object();
-			json_object_set_new(lastValueJ, "value", json_real(lastValue[i]));
+			json_object_set_new(lastValueJ, "value", json_real(lastValue[i][0].s[0]));
 			json_array_append_new(lastValuesJ, lastValueJ);
 		}
 		json_object_set_new(rootJ, "lastValue", lastValuesJ);
 
+		// All channels as packed arrays, channel by channel
+		float polyLastValue[PORT_MAX_CHANNELS * 16];
+		for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
+			for (int i = 0; i < 16; i++) {
+				polyLastValue[c * 16 + i] = lastValue[i][c / 4].s[c % 4];
+			}
+		}
+		json_object_set_new(rootJ, "polyState", Packed::toJson(&state[0][0], PORT_MAX_CHANNELS * SIZE));
+		json_object_set_new(rootJ, "polyLastValue", Packed::toJson(polyLastValue, PORT_MAX_CHANNELS * 16));
+
 		json_object_set_new(rootJ, "mode", json_integer(mode));
 		json_object_set_new(rootJ, "inverted", json_boolean(inverted));
+		json_object_set_new(rootJ, "seed", prng.toJson());
 		return rootJ;
 	}
 
 	void dataFromJson(json_t* rootJ) override {
-		json_t* statesJ = json_object_get(rootJ, "state");
-		json_t* stateJ;
-		size_t stateIndex;
-		json_array_foreach(statesJ, stateIndex, stateJ) {
-			state[stateIndex] = json_real_value(json_object_get(stateJ, "value"));
+		std::vector<float> polyState, polyLastValue;
+		if (Packed::fromJson(json_object_get(rootJ, "polyState"), polyState) && Packed::fromJson(json_object_get(rootJ, "polyLastValue"), polyLastValue)) {
+			polyState.resize(PORT_MAX_CHANNELS * SIZE, 0.f);
+			polyLastValue.resize(PORT_MAX_CHANNELS * 16, 0.f);
+			for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
+				for (int i = 0; i < SIZE; i++) {
+					state[c][i] = polyState[c * SIZE + i];
+				}
+				for (int i = 0; i < 16; i++) {
+					lastValue[i][c / 4].s[c % 4] = polyLastValue[c * 16 + i];
+				}
+			}
 		}
+		else {
+			// Patches of previous versions contain only one channel, used for all channels
+			json_t* statesJ = json_object_get(rootJ, "state");
+			json_t* stateJ;
+			size_t stateIndex;
+			json_array_foreach(statesJ, stateIndex, stateJ) {
+				for (int c = 0; c < PORT_MAX_CHANNELS; c++)
+					state[c][stateIndex] = json_real_value(json_object_get(stateJ, "value"));
+			}
 
-		json_t* lastValuesJ = json_object_get(rootJ, "lastValue");
-		json_t* lastValueJ;
-		size_t lastValueIndex;
-		json_array_foreach(lastValuesJ, lastValueIndex, lastValueJ) {
-			lastValue[lastValueIndex] = json_real_value(json_object_get(lastValueJ, "value"));
+			json_t* lastValuesJ = json_object_get(rootJ, "lastValue");
+			json_t* lastValueJ;
+			size_t lastValueIndex;
+			json_array_foreach(lastValuesJ, lastValueIndex, lastValueJ) {
+				for (int k = 0; k < PORT_MAX_CHANNELS / 4; k++)
+					lastValue[lastValueIndex][k] = json_real_value(json_object_get(lastValueJ, "value"));
+			}
 		}
 
 		json_t* modeJ = json_object_get(rootJ, "mode");
 		mode = (MODE)json_integer_value(modeJ);
 		json_t* invertedJ = json_object_get(rootJ, "inverted");
 		inverted = json_boolean_value(invertedJ);
+		prng.fromJson(json_object_get(rootJ, "seed"));
+		stateDirty = true;
 	}
 };
 
@@ -345,9 +406,11 @@ struct FourRoundsWidget : ModuleWidget {
 		menu->addChild(construct<ModeItem>(&MenuItem::text, "CV / audio", &ModeItem::module, module, &ModeItem::mode, MODE::DIRECT));
 		menu->addChild(construct<ModeItem>(&MenuItem::text, "Sample & hold", &ModeItem::module, module, &ModeItem::mode, MODE::SH));
 		menu->addChild(construct<ModeItem>(&MenuItem::text, "Quantum", &ModeItem::module, module, &ModeItem::mode, MODE::QUANTUM));
+		menu->addChild(new MenuSeparator());
+		menu->addChild(construct<PrngSeedMenuItem<FourRoundsModule>>(&MenuItem::text, "Random seed", &PrngSeedMenuItem<FourRoundsModule>::module, module));
 	}
 };
 
 } // namespace FourRounds
 
-Model *modelFourRounds = createModel<FourRounds::FourRoundsModule, FourRounds::FourRoundsWidget>("FourRounds");
\ No newline at end of file
+Model *modelFourRounds = createModelProfiled<FourRounds::FourRoundsModule, FourRounds::FourRoundsWidget>("FourRounds");
\ No newline at end of file
@@ -22,24 +22,62 @@ struct InfixModule : Module {
 		NUM_LIGHTS
 	};
 
-	int channels;
+	dsp::ClockDivider connectedDivider;
+
+	// Connected mono inputs, refreshed infrequently and whenever one of them gets unplugged
+	simd::float_4 connectedMask[4];
+	// Number of output channels needed for the highest connected mono input
+	int connectedChannels;
+	// Indices of the connected mono inputs
+	int connectedIds[16];
+	int connectedCount;
 
 	InfixModule() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 		onReset();
+		connectedDivider.setDivision(512);
+		updateConnected();
 	}
 
 	void process(const ProcessArgs &args) override {
-		int lastChannel = inputs[POLY_INPUT].getChannels();
+		// Newly connected inputs are picked up infrequently, meanwhile the poly input is used.
+		// An unplugged input would output 0V instead, so the connected ones are checked on every sample.
+		bool update = connectedDivider.process();
+		for (int i = 0; i < connectedCount && !update; i++) {
+			update = !inputs[MONO_INPUTS + connectedIds[i]].isConnected();
+		}
+		if (update) {
+			updateConnected();
+		}
+
+		for (int c = 0; c < 16; c += 4) {
+			simd::float_4 v = simd::float_4::load(inputs[POLY_INPUT].getVoltages(c));
+			simd::float_4 m = simd::float_4(
+				inputs[MONO_INPUTS + c + 0].getVoltage(),
+				inputs[MONO_INPUTS + c + 1].getVoltage(),
+				inputs[MONO_INPUTS + c + 2].getVoltage(),
+				inputs[MONO_INPUTS + c + 3].getVoltage());
+			v = simd::ifelse(connectedMask[c / 4], m, v);
+			v.store(outputs[POLY_OUTPUT].getVoltages(c));
+		}
+		outputs[POLY_OUTPUT].setChannels(std::max(inputs[POLY_INPUT].getChannels(), connectedChannels));
+	}
+
+	void updateConnected() {
+		connectedChannels = 0;
+		connectedCount = 0;
+		for (int c = 0; c < 4; c++) {
+			connectedMask[c] = simd::float_4::mask();
+		}
 		for (int c = 0; c < 16; c++) {
-			float v = inputs[POLY_INPUT].getVoltage(c);
 			if (inputs[MONO_INPUTS + c].isConnected()) {
-				lastChannel = std::max(lastChannel, c + 1);
-				v = inputs[MONO_INPUTS + c].getVoltage();
+				connectedChannels = c + 1;
+				connectedIds[connectedCount++] = c;
+			}
+			else {
+				connectedMask[c / 4].s[c % 4] = 0.f;
 			}
-			outputs[POLY_OUTPUT].setVoltage(v, c);
 		}
-		outputs[POLY_OUTPUT].setChannels(lastChannel);
 	}
 };
 
@@ -91,4 +129,4 @@ struct InfixWidget : ModuleWidget {
 
 } // namespace Infix
 
-Model* modelInfix = createModel<Infix::InfixModule, Infix::InfixWidget>("Infix");
\ No newline at end of file
+Model* modelInfix = createModelProfiled<Infix::InfixModule, Infix::InfixWidget>("Infix");
\ No newline at end of file
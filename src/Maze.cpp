@@ -1,7 +1,8 @@
 #include "plugin.hpp"
 #include "digital.hpp"
+#include "prng.hpp"
+#include "packed.hpp"
 #include <thread>
-#include <random>
 
 
 namespace Maze {
@@ -53,8 +54,8 @@ struct MazeModule : Module {
 
 	const int numPorts = NUM_PORTS;
 
-	std::default_random_engine randGen{(uint16_t)std::chrono::system_clock::now().time_since_epoch().count()};
-	std::geometric_distribution<int>* geoDist = NULL;
+	/** [Stored to JSON] */
+	Prng prng;
 
 	/** [Stored to JSON] */
 	int usedSize = 8;
@@ -109,13 +110,10 @@ struct MazeModule : Module {
 
 	MazeModule() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+		prng.setSeed(random::u64());
 		onReset();
 	}
 
-	~MazeModule() {
-		delete geoDist;
-	}
-
 	void onReset() override {
 		gridClear();
 		for (int i = 0; i < NUM_PORTS; i++) {
@@ -166,11 +164,10 @@ struct MazeModule : Module {
 						break;
 					case GRIDSTATE::RANDOM:
 						if (ratchetingEnabled) {
-							if (geoDist) 
-								multiplier[i].trigger((*geoDist)(randGen));
+							multiplier[i].trigger(prng.geometric(ratchetingProb));
 						}
 						else {
-							doPulse = random::uniform() >= 0.5f;
+							doPulse = prng.uniform() >= 0.5f;
 						}
 						break;
 				}
@@ -327,29 +324,22 @@ struct MazeModule : Module {
 	}
 
 	void ratchetingSetProb(float prob = 0.35f) {
-		if (geoDist) delete geoDist;
-		geoDist = new std::geometric_distribution<int>(prob);
 		ratchetingProb = prob;
 	}
 
 	json_t* dataToJson() override {
 		json_t* rootJ = json_object();
 
-		json_t* gridJ = json_array();
+		int32_t g[SIZE * SIZE];
+		float gCv[SIZE * SIZE];
 		for (int i = 0; i < SIZE; i++) {
 			for (int j = 0; j < SIZE; j++) {
-				json_array_append_new(gridJ, json_integer(grid[i][j]));
+				g[i * SIZE + j] = grid[i][j];
+				gCv[i * SIZE + j] = gridCv[i][j];
 			}
 		}
-		json_object_set_new(rootJ, "grid", gridJ);
-
-		json_t* gridCvJ = json_array();
-		for (int i = 0; i < SIZE; i++) {
-			for (int j = 0; j < SIZE; j++) {
-				json_array_append_new(gridCvJ, json_real(gridCv[i][j]));
-			}
-		}
-		json_object_set_new(rootJ, "gridCv", gridCvJ);
+		json_object_set_new(rootJ, "grid", Packed::toJson(g, SIZE * SIZE));
+		json_object_set_new(rootJ, "gridCv", Packed::toJson(gCv, SIZE * SIZE));
 
 		json_t* portsJ = json_array();
 		for (int i = 0; i < NUM_PORTS; i++) {
@@ -371,21 +361,21 @@ struct MazeModule : Module {
 		json_object_set_new(rootJ, "usedSize", json_integer(usedSize));
 		json_object_set_new(rootJ, "ratchetingEnabled", json_boolean(ratchetingEnabled));
 		json_object_set_new(rootJ, "ratchetingProb", json_real(ratchetingProb));
+		json_object_set_new(rootJ, "seed", prng.toJson());
 		return rootJ;
 	}
 
 	void dataFromJson(json_t* rootJ) override {
-		json_t* gridJ = json_object_get(rootJ, "grid");
-		for (int i = 0; i < SIZE; i++) {
-			for (int j = 0; j < SIZE; j++) {
-				grid[i][j] = (GRIDSTATE)json_integer_value(json_array_get(gridJ, i * SIZE + j));
-			}
-		}
-		
-		json_t* gridCvJ = json_object_get(rootJ, "gridCv");
+		std::vector<int32_t> g;
+		Packed::fromJson(json_object_get(rootJ, "grid"), g);
+		g.resize(SIZE * SIZE, 0);
+		std::vector<float> gCv;
+		Packed::fromJson(json_object_get(rootJ, "gridCv"), gCv);
+		gCv.resize(SIZE * SIZE, 0.f);
 		for (int i = 0; i < SIZE; i++) {
 			for (int j = 0; j < SIZE; j++) {
-				gridCv[i][j] = json_real_value(json_array_get(gridCvJ, i * SIZE + j));
+				grid[i][j] = (GRIDSTATE)g[i * SIZE + j];
+				gridCv[i][j] = gCv[i * SIZE + j];
 			}
 		}
 
@@ -407,7 +397,8 @@ struct MazeModule : Module {
 
 		usedSize = json_integer_value(json_object_get(rootJ, "usedSize"));
 		ratchetingEnabled = json_boolean_value(json_object_get(rootJ, "ratchetingEnabled"));
-		ratchetingProb = json_real_value(json_object_get(rootJ, "ratchetingProb"));
+		ratchetingProb = clamp((float)json_number_value(json_object_get(rootJ, "ratchetingProb")), 0.f, 1.f);
+		prng.fromJson(json_object_get(rootJ, "seed"));
 		gridDirty = true;
 	}
 };
@@ -921,6 +912,7 @@ struct MazeScreenWidget : OpaqueWidget, MazeDrawHelper<MODULE> {
 		menu->addChild(new MenuSeparator());
 		menu->addChild(construct<RatchetingMenuItem<MODULE>>(&MenuItem::text, "Ratcheting", &RatchetingMenuItem<MODULE>::module, module));
 		menu->addChild(construct<RatchetingProbMenuItem<MODULE>>(&MenuItem::text, "Ratcheting probability", &RatchetingProbMenuItem<MODULE>::module, module));
+		menu->addChild(construct<PrngSeedMenuItem<MODULE>>(&MenuItem::text, "Random seed", &PrngSeedMenuItem<MODULE>::module, module));
 		menu->addChild(new MenuSeparator());
 		menu->addChild(construct<MenuLabel>(&MenuLabel::text, "Grid"));
 		SizeSlider<MODULE>* sizeSlider = new SizeSlider<MODULE>(module);
@@ -1005,4 +997,4 @@ struct MazeWidget32 : ModuleWidget {
 
 } // namespace Maze
 
-Model* modelMaze = createModel<Maze::MazeModule<32, 4>, Maze::MazeWidget32>("Maze");
\ No newline at end of file
+Model* modelMaze = createModelProfiled<Maze::MazeModule<32, 4>, Maze::MazeWidget32>("Maze");
\ No newline at end of file
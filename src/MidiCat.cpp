@@ -918,4 +918,4 @@ struct MidiCatWidget : ModuleWidget {
 
 } // namespace MidiCat
 
-Model *modelMidiCat = createModel<MidiCat::MidiCatModule, MidiCat::MidiCatWidget>("MidiCat");
\ No newline at end of file
+Model *modelMidiCat = createModelProfiled<MidiCat::MidiCatModule, MidiCat::MidiCatWidget>("MidiCat");
\ No newline at end of file
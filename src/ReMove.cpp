@@ -1,7 +1,8 @@
 #include "plugin.hpp"
 #include "MapModule.hpp"
+#include "packed.hpp"
+#include "prng.hpp"
 #include <thread>
-#include <random>
 
 
 namespace ReMove {
@@ -140,8 +141,8 @@ struct ReMoveModule : MapModule<1> {
     PLAYMODE playMode = PLAYMODE_LOOP;
     int playDir = REMOVE_PLAYDIR_FWD;
 
-    std::default_random_engine randGen{(uint16_t)std::chrono::system_clock::now().time_since_epoch().count()};
-    std::uniform_int_distribution<int> randDist{0, REMOVE_MAX_SEQ - 1};
+    /** [Stored to JSON] */
+    Prng prng;
 
     /** [Stored to JSON] state of playback (for button-press manually) */
     bool isPlaying = false;
@@ -182,6 +183,7 @@ struct ReMoveModule : MapModule<1> {
         paramHandles[0].text = "ReMove Lite";
 
         lightDivider.setDivision(1024);
+        prng.setSeed(random::u64());
         onReset();
     }
 
@@ -559,7 +561,7 @@ struct ReMoveModule : MapModule<1> {
     }
 
     inline void seqRand() {
-        seq = randDist(randGen) % seqCount;
+        seq = prng.uniformInt(seqCount);
         seqUpdate();
     }
 
@@ -614,25 +616,7 @@ struct ReMoveModule : MapModule<1> {
         int s = REMOVE_MAX_DATA / seqCount;
         json_t *seqDataJ = json_array();
         for (int i = 0; i < seqCount; i++) {
-            json_t *seqData1J = json_array();
-            float last1 = 100.f, last2 = -100.f;
-            for (int j = 0; j < seqLength[i]; j++) {
-                if (last1 == last2) {
-                    // 2 times same value -> compress!
-                    int c = 0;
-                    while (seqData[i * s + j] == last1 && j < seqLength[i]) { c++; j++; }
-                    json_array_append_new(seqData1J, json_integer(c));
-                    if (j < seqLength[i]) json_array_append_new(seqData1J, json_real(seqData[i * s + j]));
-                    last2 = -100.f;
-                    last1 = seqData[i * s + j];
-                } 
-                else {
-                    json_array_append_new(seqData1J, json_real(seqData[i * s + j]));
-                    last2 = last1;
-                    last1 = seqData[i * s + j];
-                }
-            }
-            json_array_append_new(seqDataJ, seqData1J);
+            json_array_append_new(seqDataJ, Packed::toJson(&seqData[i * s], seqLength[i]));
         }
         json_object_set_new(rec0J, "seqData", seqDataJ);
 
@@ -655,6 +639,7 @@ struct ReMoveModule : MapModule<1> {
         json_object_set_new(rec0J, "playMode", json_integer(playMode));
         json_object_set_new(rec0J, "sampleRate", json_real(sampleRate));
         json_object_set_new(rec0J, "isPlaying", json_boolean(isPlaying));
+        json_object_set_new(rec0J, "seed", prng.toJson());
 
         json_t *recJ = json_array();
         json_array_append_new(recJ, rec0J);
@@ -695,6 +680,7 @@ struct ReMoveModule : MapModule<1> {
         if (sampleRateJ) sampleRate = json_real_value(sampleRateJ);
         json_t *isPlayingJ = json_object_get(rec0J, "isPlaying");
         if (isPlayingJ) isPlaying = json_boolean_value(isPlayingJ);
+        prng.fromJson(json_object_get(rec0J, "seed"));
 
         json_t *seqLengthJ = json_object_get(rec0J, "seqLength");
         if (seqLengthJ) {
@@ -713,6 +699,14 @@ struct ReMoveModule : MapModule<1> {
             size_t i;
             json_array_foreach(seqDataJ, i, seqData1J) {
                 if ((int)i >= seqCount) continue;
+                std::vector<float> v;
+                if (json_is_string(seqData1J)) {
+                    if (Packed::fromJson(seqData1J, v)) {
+                        std::copy(v.begin(), v.begin() + std::min((int)v.size(), s), &seqData[i * s]);
+                    }
+                    continue;
+                }
+                // Run-length encoded arrays of previous versions
                 size_t j;
                 float last1 = 100.f, last2 = -100.f;
                 int c = 0;
@@ -740,9 +734,9 @@ struct ReMoveModule : MapModule<1> {
     }
 
     void onRandomize() override {
-        unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-        std::default_random_engine gen(seed);
-        std::normal_distribution<float> d{0.f, 0.1f};
+        Prng gen;
+        gen.setSeed(random::u64());
+        auto d = [&gen]() { return gen.normal() * 0.1f; };
         dsp::ExponentialFilter filter;
         filter.setLambda(sampleRate * 10.f);
 
@@ -752,13 +746,13 @@ struct ReMoveModule : MapModule<1> {
 
         for (int i = 0; i < seqCount; i++) {
             // Set some start-value for the exponential filter
-            filter.out = 0.5f + d(gen) * 10.f;
+            filter.out = 0.5f + d() * 10.f;
             float dir = 1.f;
             float p = 0.5f;
             for (int c = 0; c < l; c++) {
                 // Reduce the number of direction changes, only when rand > 0
-                if (c % (l / 8) == 0) dir = d(gen) >= 0 ? 1 : -1;
-                float r = d(gen);
+                if (c % (l / 8) == 0) dir = d() >= 0 ? 1 : -1;
+                float r = d();
                 // Inject some static in the curve
                 p = filter.process(1.f, r >= 0.005f ? p + dir * abs(r) : p);
                 // Only range [0,1] is valid
@@ -1267,6 +1261,8 @@ struct ReMoveWidget : ModuleWidget {
         playModeMenuItem->rightText = RIGHT_ARROW;
         menu->addChild(playModeMenuItem);
 
+        menu->addChild(construct<PrngSeedMenuItem<ReMoveModule>>(&MenuItem::text, "Random seed", &PrngSeedMenuItem<ReMoveModule>::module, module));
+
         menu->addChild(new MenuSeparator());
 
         SeqCvModeMenuItem *seqCvModeMenuItem = construct<SeqCvModeMenuItem>(&MenuItem::text, "Port SEQ# mode", &SeqCvModeMenuItem::module, module);
@@ -1293,4 +1289,4 @@ struct ReMoveWidget : ModuleWidget {
 
 } // namespace ReMove
 
-Model *modelReMoveLite = createModel<ReMove::ReMoveModule, ReMove::ReMoveWidget>("ReMoveLite");
\ No newline at end of file
+Model *modelReMoveLite = createModelProfiled<ReMove::ReMoveModule, ReMove::ReMoveWidget>("ReMoveLite");
\ No newline at end of file
@@ -4,6 +4,15 @@
 
 namespace RotorA {
 
+enum CURVE {
+	LINEAR = 0,
+	EQUAL_POWER = 1,
+	WIDE = 2
+};
+
+// Number of segments of the gain tables, spanning distances from 0 to 2 channels
+const int CURVE_TABLE_SIZE = 64;
+
 struct RotorAModule : Module {
 	enum ParamIds {
 		CHANNELS_PARAM,
@@ -25,12 +34,21 @@ struct RotorAModule : Module {
 		NUM_LIGHTS
 	};
 
+	/** [Stored to JSON] */
+	CURVE curve = CURVE::LINEAR;
+
 	dsp::ClockDivider lightDivider;
 	dsp::ClockDivider channelsDivider;
 
 	int channels;
 	simd::float_4 channelsMask[4];
-	float channelsSplit;
+	// Scales the modulator voltage to the position between the output channels
+	float channelsScale;
+	// Position of each output channel
+	simd::float_4 channelsPos[4];
+	// Gains of the cosine curves by distance, interpolated linearly instead of evaluating cos per sample
+	float equalPowerTable[CURVE_TABLE_SIZE + 2];
+	float wideTable[CURVE_TABLE_SIZE + 2];
 
 	RotorAModule() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
@@ -39,8 +57,48 @@ struct RotorAModule : Module {
 		onReset();
 		lightDivider.setDivision(2048);
 		channelsDivider.setDivision(512);
+		for (int c = 0; c < 16; c += 4) {
+			channelsPos[c / 4] = simd::float_4(c, c + 1, c + 2, c + 3);
+		}
+		for (int i = 0; i < CURVE_TABLE_SIZE + 2; i++) {
+			float d = std::min(2.f * i / CURVE_TABLE_SIZE, 2.f);
+			equalPowerTable[i] = std::cos(std::min(d, 1.f) * float(M_PI_2));
+			// Raised cosine spanning four channels, the gains sum up to 1
+			wideTable[i] = (1.f + std::cos(d * 0.5f * float(M_PI))) * 0.25f;
+		}
 		channels = ceil(params[CHANNELS_PARAM].getValue());
-		channelsSplit = 10.f / (float)(channels - 1);
+		channelsScale = (float)(channels - 1) / 10.f;
+	}
+
+	void onReset() override {
+		Module::onReset();
+		curve = CURVE::LINEAR;
+	}
+
+	/** Gain of an output channel at distance `d` to the position of the modulator */
+	inline simd::float_4 kernel(simd::float_4 d) {
+		switch (curve) {
+			default:
+			case CURVE::LINEAR:
+				return simd::fmax(1.f - d, 0.f);
+			case CURVE::EQUAL_POWER:
+				return lookup(equalPowerTable, d);
+			case CURVE::WIDE:
+				return lookup(wideTable, d);
+		}
+	}
+
+	/** Interpolates the gain `table` at the distances `d` */
+	inline simd::float_4 lookup(const float* table, simd::float_4 d) {
+		simd::float_4 x = simd::fmin(d, 2.f) * float(CURVE_TABLE_SIZE / 2);
+		simd::float_4 i = simd::floor(x);
+		simd::float_4 a, b;
+		for (int k = 0; k < 4; k++) {
+			int j = (int)i.s[k];
+			a.s[k] = table[j];
+			b.s[k] = table[j + 1];
+		}
+		return a + (b - a) * (x - i);
 	}
 
 	void process(const ProcessArgs &args) override {
@@ -53,24 +111,24 @@ struct RotorAModule : Module {
 			for (int c = inputs[BASE_INPUT].getChannels(); c < 16; c++) {
 				channelsMask[c / 4].s[c % 4] = 0.f;
 			}
-			channelsSplit = 10.f / (float)(channels - 1);
+			channelsScale = (float)(channels - 1) / 10.f;
 		}
 
-		float car = inputs[CAR_INPUT].isConnected() ? clamp(inputs[CAR_INPUT].getVoltage(), 0.f, 10.f) : 10.f;
-
 		simd::float_4 v[4];
 		for (int c = 0; c < 16; c += 4) {
 			v[c / 4] = 0.f;
 		}
 
-		float mod = clamp(inputs[MOD_INPUT].getVoltage(), 0.f, 10.f);
-		float mod_p = mod / channelsSplit;
-		int mod_c = floor(mod_p);
-		float mod_p2 = mod_p - (float)mod_c;
-		float mod_p1 = 1.f - mod_p2;
-
-		v[(mod_c + 0) / 4].s[(mod_c + 0) % 4] = mod_p1 * car;
-		v[(mod_c + 1) / 4].s[(mod_c + 1) % 4] = mod_p2 * car;
+		// Each channel of MOD rotates the carrier on the same channel of CAR, monophonic CAR is used for all
+		int modChannels = std::max(inputs[MOD_INPUT].getChannels(), 1);
+		for (int i = 0; i < modChannels; i++) {
+			float car = inputs[CAR_INPUT].isConnected() ? clamp(inputs[CAR_INPUT].getPolyVoltage(i), 0.f, 10.f) : 10.f;
+			float mod = clamp(inputs[MOD_INPUT].getVoltage(i), 0.f, 10.f);
+			float mod_p = mod * channelsScale;
+			for (int c = 0; c < channels; c += 4) {
+				v[c / 4] += kernel(simd::fabs(channelsPos[c / 4] - mod_p)) * car;
+			}
+		}
 
 		if (outputs[POLY_OUTPUT].isConnected()) {
 			outputs[POLY_OUTPUT].setChannels(channels);
@@ -95,6 +153,17 @@ struct RotorAModule : Module {
 			}
 		}
 	}
+
+	json_t* dataToJson() override {
+		json_t* rootJ = json_object();
+		json_object_set_new(rootJ, "curve", json_integer(curve));
+		return rootJ;
+	}
+
+	void dataFromJson(json_t* rootJ) override {
+		json_t* curveJ = json_object_get(rootJ, "curve");
+		if (curveJ) curve = (CURVE)json_integer_value(curveJ);
+	}
 };
 
 
@@ -131,9 +200,42 @@ struct RotorAWidget : ModuleWidget {
 		};
 
 		menu->addChild(construct<ManualItem>(&MenuItem::text, "Module Manual"));
+		menu->addChild(new MenuSeparator());
+
+		RotorAModule* module = dynamic_cast<RotorAModule*>(this->module);
+		assert(module);
+
+		struct CurveMenuItem : MenuItem {
+			RotorAModule* module;
+			CurveMenuItem() {
+				rightText = RIGHT_ARROW;
+			}
+
+			Menu* createChildMenu() override {
+				struct CurveItem : MenuItem {
+					RotorAModule* module;
+					CURVE curve;
+					void onAction(const event::Action& e) override {
+						module->curve = curve;
+					}
+					void step() override {
+						rightText = module->curve == curve ? "✔" : "";
+						MenuItem::step();
+					}
+				};
+
+				Menu* menu = new Menu;
+				menu->addChild(construct<CurveItem>(&MenuItem::text, "Linear", &CurveItem::module, module, &CurveItem::curve, CURVE::LINEAR));
+				menu->addChild(construct<CurveItem>(&MenuItem::text, "Equal power", &CurveItem::module, module, &CurveItem::curve, CURVE::EQUAL_POWER));
+				menu->addChild(construct<CurveItem>(&MenuItem::text, "Wide", &CurveItem::module, module, &CurveItem::curve, CURVE::WIDE));
+				return menu;
+			}
+		};
+
+		menu->addChild(construct<CurveMenuItem>(&MenuItem::text, "Crossfade curve", &CurveMenuItem::module, module));
 	};
 };
 
 } // namespace RotorA
 
-Model* modelRotorA = createModel<RotorA::RotorAModule, RotorA::RotorAWidget>("RotorA");
\ No newline at end of file
+Model* modelRotorA = createModelProfiled<RotorA::RotorAModule, RotorA::RotorAWidget>("RotorA");
\ No newline at end of file
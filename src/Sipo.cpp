@@ -1,11 +1,31 @@
 #include "plugin.hpp"
+#include "packed.hpp"
 #include <thread>
 
 namespace Sipo {
 
-static const int MAX_DATA = 4096;
-static const int MAX_DATA_32 = MAX_DATA / 32;
-static const int MAX_DATA_32_16 = MAX_DATA_32 / PORT_MAX_CHANNELS;
+// Buffer lengths are powers of two so the ring buffer wraps by masking
+static const int MIN_DATA = 4096;
+static const int MAX_DATA = 1 << 19;
+
+struct DataBuffer {
+	float* data;
+	int length;
+	int ptr = 0;
+	int used = 0;
+	// Take over the most recent values of the previous buffer
+	bool keep = true;
+
+	DataBuffer(int length) {
+		this->length = length;
+		data = new float[length];
+		std::fill(data, data + length, 0.f);
+	}
+
+	~DataBuffer() {
+		delete[] data;
+	}
+};
 
 struct SipoModule : Module {
 	enum ParamIds {
@@ -31,50 +51,108 @@ struct SipoModule : Module {
 
 	dsp::SchmittTrigger clockTrigger;
 
+	/** [Stored to JSON] */
+	DataBuffer* buffer;
 	float* data;
+	int dataMask;
 	int dataPtr = 0;
 	int dataUsed = 0;
+	// Buffer handed over from the UI thread, replaced on a call of process() once bufferOld is free
+	std::atomic<DataBuffer*> bufferNew{NULL};
+	// Replaced buffer, set by the engine thread only and deleted by the UI thread
+	std::atomic<DataBuffer*> bufferOld{NULL};
+
+	/** [Stored to JSON] */
+	bool saveData = true;
+	// Set by the engine thread whenever the buffer changes
+	std::atomic<bool> dataDirty{true};
+	// Last encoding of the buffer, reused by dataToJson() while the buffer is unchanged
+	json_t* dataCache = NULL;
+
+	// Distance of the tap of each output channel to dataPtr
+	int tapOffset[PORT_MAX_CHANNELS];
+	int lastSkip = -1;
+	int lastIncr = -1;
 
 	dsp::ClockDivider lightDivider;
 
 	SipoModule() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
-		configParam(SKIP_PARAM, 0.f, MAX_DATA_32 - 1, 0.f, "Trigger-skip to the current value, 0 acts as a standard shift register");
-		configParam(INCR_PARAM, 0.f, MAX_DATA_32_16, 0.f, "Inrement between used cells, 0 acts as standard shift register");
-		data = new float[MAX_DATA];
+		configParam(SKIP_PARAM, 0.f, MIN_DATA / 32 - 1, 0.f, "Trigger-skip to the current value, 0 acts as a standard shift register");
+		configParam(INCR_PARAM, 0.f, MIN_DATA / 32 / PORT_MAX_CHANNELS, 0.f, "Inrement between used cells, 0 acts as standard shift register");
+		buffer = new DataBuffer(MIN_DATA);
+		bufferSwap(buffer);
 
 		onReset();
 		lightDivider.setDivision(512);
 	}
 
 	~SipoModule() {
-		delete[] data;
+		delete bufferNew.exchange(NULL);
+		delete bufferOld.exchange(NULL);
+		delete buffer;
+		if (dataCache) json_decref(dataCache);
 	}
 
 	void onReset() override {
+		delete bufferOld.exchange(NULL);
 		dataPtr = 0;
 		dataUsed = 0;
-		for (int i = 0; i < MAX_DATA; i++) {
-			data[i] = 0.f;
-		}
+		std::fill(data, data + dataMask + 1, 0.f);
+		dataDirty = true;
 	}
 
 	void process(const ProcessArgs &args) override {
-		outputs[POLY_OUTPUT].setChannels(PORT_MAX_CHANNELS);
+		// The replaced buffer is never freed here, a new one is taken only after the last one has been deleted
+		DataBuffer* b = bufferOld.load() ? NULL : bufferNew.exchange(NULL);
+		if (b) {
+			if (b->keep) {
+				// Copy the most recent values, the current one ends up at the new dataPtr
+				b->used = std::min(dataUsed, b->length);
+				b->ptr = b->used > 0 ? b->used - 1 : 0;
+				for (int i = 0; i < b->used; i++) {
+					b->data[b->ptr - i] = data[(dataPtr - i) & dataMask];
+				}
+			}
+			bufferOld = buffer;
+			bufferSwap(b);
+			dataDirty = true;
+		}
+
+		if (outputs[POLY_OUTPUT].getChannels() != PORT_MAX_CHANNELS) {
+			outputs[POLY_OUTPUT].setChannels(PORT_MAX_CHANNELS);
+		}
 
 		if (clockTrigger.process(inputs[TRIG_INPUT].getVoltage())) {
-			dataPtr = (dataPtr + 1) % MAX_DATA;
-			dataUsed = std::min(dataUsed + 1, MAX_DATA);
+			dataPtr = (dataPtr + 1) & dataMask;
+			dataUsed = std::min(dataUsed + 1, dataMask + 1);
 			data[dataPtr] = inputs[SRC_INPUT].getVoltage();
+			dataDirty.store(true, std::memory_order_relaxed);
 		}
 
-		int skipCv = std::round(rescale(inputs[SKIP_INPUT].getVoltage(), 0.f, 10.f, 0, MAX_DATA_32 - 1));
-		int skip = 1 + (int)clamp((int)params[SKIP_PARAM].getValue() + skipCv, 0, MAX_DATA_32 - 1);
-		int incrCv = std::round(rescale(inputs[INCR_INPUT].getVoltage(), 0.f, 10.f, 0, MAX_DATA_32_16));
-		int incr = (int)clamp((int)params[INCR_PARAM].getValue() + incrCv, 0, MAX_DATA_32_16);
+		int skipMax = (dataMask + 1) / 32 - 1;
+		int incrMax = (dataMask + 1) / 32 / PORT_MAX_CHANNELS;
+		int skipCv = std::round(rescale(inputs[SKIP_INPUT].getVoltage(), 0.f, 10.f, 0, skipMax));
+		int skip = 1 + (int)clamp((int)params[SKIP_PARAM].getValue() + skipCv, 0, skipMax);
+		int incrCv = std::round(rescale(inputs[INCR_INPUT].getVoltage(), 0.f, 10.f, 0, incrMax));
+		int incr = (int)clamp((int)params[INCR_PARAM].getValue() + incrCv, 0, incrMax);
+
+		if (skip != lastSkip || incr != lastIncr) {
+			lastSkip = skip;
+			lastIncr = incr;
+			for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
+				tapOffset[c] = (skip + incr * c) * c;
+			}
+		}
 
-		for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
-			outputs[POLY_OUTPUT].setVoltage(data[(dataPtr - (skip + incr * c) * c + MAX_DATA) % MAX_DATA], c);
+		for (int c = 0; c < PORT_MAX_CHANNELS; c += 4) {
+			simd::float_4 v = {
+				data[(dataPtr - tapOffset[c + 0]) & dataMask],
+				data[(dataPtr - tapOffset[c + 1]) & dataMask],
+				data[(dataPtr - tapOffset[c + 2]) & dataMask],
+				data[(dataPtr - tapOffset[c + 3]) & dataMask]
+			};
+			outputs[POLY_OUTPUT].setVoltageSimd(v, c);
 		}
 
 		// Set channel lights infrequently
@@ -87,32 +165,106 @@ struct SipoModule : Module {
 		}
 	}
 
+	/** Makes `b` the current buffer, to be called only from the engine thread or before processing started */
+	void bufferSwap(DataBuffer* b) {
+		buffer = b;
+		data = b->data;
+		dataMask = b->length - 1;
+		dataPtr = b->ptr;
+		dataUsed = b->used;
+		// The ranges of SKIP and INCR grow with the buffer
+		paramQuantities[SKIP_PARAM]->maxValue = b->length / 32 - 1;
+		paramQuantities[INCR_PARAM]->maxValue = b->length / 32 / PORT_MAX_CHANNELS;
+	}
+
+	/** Hands `b` over to the engine thread, called from the UI thread */
+	void bufferRequest(DataBuffer* b) {
+		delete bufferOld.exchange(NULL);
+		delete bufferNew.exchange(b);
+	}
+
+	int getDataLength() {
+		DataBuffer* b = bufferNew;
+		return b ? b->length : dataMask + 1;
+	}
+
+	void setDataLength(int length) {
+		bufferRequest(new DataBuffer(length));
+	}
+
+	/** Encodes the used part of a buffer as packed array, ordered from the oldest to the most recent value */
+	json_t* dataEncode(const float* data, int mask, int ptr, int used) {
+		std::vector<float> v(used);
+		for (int i = 0; i < used; i++) {
+			v[i] = data[(ptr - (used - 1) + i) & mask];
+		}
+		return Packed::toJson(v.data(), used);
+	}
+
 	json_t* dataToJson() override {
 		json_t* rootJ = json_object();
 
-		json_t* dataJ = json_array();
-		for (int i = 0; i < dataUsed; i++) {
-			json_t* d = json_real(data[i]);
-			json_array_append(dataJ, d);
+		// A buffer not yet taken over by the engine thread is stored instead of the current one,
+		// it is held back meanwhile so process() can't swap it in while being encoded
+		DataBuffer* b = bufferNew.exchange(NULL);
+		int length = b ? b->length : dataMask + 1;
+
+		if (saveData) {
+			if (b && !b->keep) {
+				json_object_set_new(rootJ, "dataBlob", dataEncode(b->data, b->length - 1, b->ptr, b->used));
+			}
+			else {
+				if (dataDirty.exchange(false) || !dataCache) {
+					if (dataCache) json_decref(dataCache);
+					dataCache = dataEncode(data, dataMask, dataPtr, dataUsed);
+				}
+				json_object_set(rootJ, "dataBlob", dataCache);
+			}
 		}
-		json_object_set_new(rootJ, "data", dataJ);
 
-		json_object_set_new(rootJ, "dataPtr", json_integer(dataPtr));
+		// Buffers are requested on the UI thread only, so bufferNew is still empty here
+		if (b) bufferNew = b;
+
+		json_object_set_new(rootJ, "dataLength", json_integer(length));
+		json_object_set_new(rootJ, "saveData", json_boolean(saveData));
 		return rootJ;
 	}
 
 	void dataFromJson(json_t *rootJ) override {
+		json_t* saveDataJ = json_object_get(rootJ, "saveData");
+		if (saveDataJ) saveData = json_boolean_value(saveDataJ);
+
+		json_t* dataLengthJ = json_object_get(rootJ, "dataLength");
+		int length = dataLengthJ ? json_integer_value(dataLengthJ) : MIN_DATA;
+		length = clamp(length, MIN_DATA, MAX_DATA);
+		// Round up to the next power of two
+		while (length & (length - 1)) length += length & -length;
+		DataBuffer* b = new DataBuffer(length);
+		b->keep = false;
+
+		json_t* dataBlobJ = json_object_get(rootJ, "dataBlob");
 		json_t* dataJ = json_object_get(rootJ, "data");
-		if (dataJ) {
+		std::vector<float> v;
+		if (json_is_string(dataBlobJ) && Packed::fromJson(dataBlobJ, v)) {
+			int n = std::min((int)v.size(), length);
+			// Keep the most recent values if the blob is longer than the buffer
+			std::copy(v.end() - n, v.end(), b->data);
+			b->used = n;
+			b->ptr = n > 0 ? n - 1 : 0;
+		}
+		else if (dataJ) {
+			// Patches of previous versions store an array of values and the current position
 			json_t *d;
 			size_t dataIndex;
 			json_array_foreach(dataJ, dataIndex, d) {
-				data[dataIndex] = json_real_value(d);
+				if ((int)dataIndex >= length) break;
+				b->data[dataIndex] = json_real_value(d);
 			}
-			dataUsed = dataIndex;
+			b->used = std::min((int)json_array_size(dataJ), length);
+			b->ptr = json_integer_value(json_object_get(rootJ, "dataPtr")) & (length - 1);
 		}
 
-		dataPtr = json_integer_value(json_object_get(rootJ, "dataPtr"));
+		bufferRequest(b);
 	}
 };
 
@@ -157,9 +309,53 @@ struct SipoWidget : ModuleWidget {
 		};
 
 		menu->addChild(construct<ManualItem>(&MenuItem::text, "Module Manual"));
+		menu->addChild(new MenuSeparator());
+
+		struct DataLengthMenuItem : MenuItem {
+			SipoModule* module;
+			DataLengthMenuItem() {
+				rightText = RIGHT_ARROW;
+			}
+
+			Menu* createChildMenu() override {
+				struct DataLengthItem : MenuItem {
+					SipoModule* module;
+					int length;
+					void onAction(const event::Action& e) override {
+						module->setDataLength(length);
+					}
+					void step() override {
+						rightText = module->getDataLength() == length ? "✔" : "";
+						MenuItem::step();
+					}
+				};
+
+				Menu* menu = new Menu;
+				for (int length = MIN_DATA; length <= MAX_DATA; length *= 2) {
+					float s = length / APP->engine->getSampleRate();
+					std::string text = string::f("%i (%.2fs at audio rate)", length, s);
+					menu->addChild(construct<DataLengthItem>(&MenuItem::text, text, &DataLengthItem::module, module, &DataLengthItem::length, length));
+				}
+				return menu;
+			}
+		};
+
+		struct SaveDataItem : MenuItem {
+			SipoModule* module;
+			void onAction(const event::Action& e) override {
+				module->saveData ^= true;
+			}
+			void step() override {
+				rightText = module->saveData ? "✔" : "";
+				MenuItem::step();
+			}
+		};
+
+		menu->addChild(construct<DataLengthMenuItem>(&MenuItem::text, "Buffer length", &DataLengthMenuItem::module, module));
+		menu->addChild(construct<SaveDataItem>(&MenuItem::text, "Store buffer in patch", &SaveDataItem::module, module));
 	}
 };
 
 } // namespace Sipo
 
-Model* modelSipo = createModel<Sipo::SipoModule, Sipo::SipoWidget>("Sipo");
\ No newline at end of file
+Model* modelSipo = createModelProfiled<Sipo::SipoModule, Sipo::SipoWidget>("Sipo");
\ No newline at end of file
@@ -1207,4 +1207,4 @@ struct StripWidget : ModuleWidget {
 
 } // namespace Strip
 
-Model *modelStrip = createModel<Strip::StripModule, Strip::StripWidget>("Strip");
\ No newline at end of file
+Model *modelStrip = createModelProfiled<Strip::StripModule, Strip::StripWidget>("Strip");
\ No newline at end of file
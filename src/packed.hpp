@@ -0,0 +1,87 @@
+#pragma once
+#include "plugin.hpp"
+
+
+/**
+ * Serialization of float and int arrays as a single JSON string instead of one JSON value per
+ * element. The string starts with a type and version tag followed by the base64-encoded 32-bit
+ * values in the byte order of the machine, e.g. "f1:AACAPwAAAEA=".
+ *
+ * The readers also accept the layouts of previous versions: a plain JSON array of numbers and,
+ * for floats, an untagged base64 string.
+ */
+namespace Packed {
+
+static const int VERSION = 1;
+
+template <typename T>
+json_t* encode(char type, const T* v, size_t n) {
+	static_assert(sizeof(T) == 4, "only 32-bit values are supported");
+	std::string s = string::f("%c%d:", type, VERSION);
+	s += string::toBase64((const uint8_t*)v, n * sizeof(T));
+	return json_string(s.c_str());
+}
+
+template <typename T>
+bool decode(char type, json_t* j, std::vector<T>& v) {
+	const char* s = json_string_value(j);
+	const char* p = std::strchr(s, ':');
+	if (p) {
+		int version = std::atoi(s + 1);
+		if (s[0] != type || version < 1 || version > VERSION) {
+			WARN("Packed array of unknown type or version %s", std::string(s, p - s).c_str());
+			return false;
+		}
+		s = p + 1;
+	}
+	else if (type != 'f') {
+		return false;
+	}
+
+	size_t size;
+	uint8_t* blob = string::fromBase64(s, &size);
+	if (!blob) return false;
+	v.resize(size / sizeof(T));
+	std::memcpy(v.data(), blob, v.size() * sizeof(T));
+	free(blob);
+	return true;
+}
+
+inline json_t* toJson(const float* v, size_t n) {
+	return encode('f', v, n);
+}
+
+inline json_t* toJson(const int32_t* v, size_t n) {
+	return encode('i', v, n);
+}
+
+/** Reads a packed string or a JSON array of numbers into `v`, returns false if `j` is neither */
+inline bool fromJson(json_t* j, std::vector<float>& v) {
+	if (json_is_string(j)) {
+		return decode('f', j, v);
+	}
+	if (json_is_array(j)) {
+		v.resize(json_array_size(j));
+		for (size_t i = 0; i < v.size(); i++) {
+			v[i] = json_number_value(json_array_get(j, i));
+		}
+		return true;
+	}
+	return false;
+}
+
+inline bool fromJson(json_t* j, std::vector<int32_t>& v) {
+	if (json_is_string(j)) {
+		return decode('i', j, v);
+	}
+	if (json_is_array(j)) {
+		v.resize(json_array_size(j));
+		for (size_t i = 0; i < v.size(); i++) {
+			v[i] = json_integer_value(json_array_get(j, i));
+		}
+		return true;
+	}
+	return false;
+}
+
+} // namespace Packed
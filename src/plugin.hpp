@@ -1,5 +1,6 @@
 #include "rack.hpp"
 #include "components.hpp"
+#include "profiler.hpp"
 
 using namespace rack;
 
@@ -0,0 +1,184 @@
+#pragma once
+#include "plugin.hpp"
+
+
+/**
+ * Seedable pseudo random number generator based on xoshiro128+, running four independent
+ * streams side by side. The streams are laid out lane by lane so one step yields a batch of
+ * four values, computed with plain loops the compiler vectorizes. Scalar draws are served
+ * from a small buffer of precomputed values.
+ */
+struct Prng {
+	static const int BUFFER = 8;
+
+	uint64_t seed = 0;
+	/**
+	 * Restore the seed from the patch, so the sequence restarts identically after loading and
+	 * duplicates of a module share it. Otherwise every instance keeps the seed it has been
+	 * created with.
+	 */
+	bool reproducible = false;
+	// State word i of stream j in s[i][j]
+	uint32_t s[4][4];
+
+	float uniformBuffer[BUFFER];
+	int uniformIndex = BUFFER;
+	float normalBuffer[BUFFER];
+	int normalIndex = BUFFER;
+
+	Prng() {
+		setSeed(0);
+	}
+
+	/** Restarts the generator, the same seed always produces the same sequence */
+	void setSeed(uint64_t seed) {
+		this->seed = seed;
+		// Expand the seed into the state of all streams by splitmix64, which never yields an all-zero state
+		uint64_t x = seed;
+		for (int j = 0; j < 4; j++) {
+			for (int i = 0; i < 4; i += 2) {
+				uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+				z = z ^ (z >> 31);
+				s[i + 0][j] = uint32_t(z);
+				s[i + 1][j] = uint32_t(z >> 32);
+			}
+		}
+		uniformIndex = BUFFER;
+		normalIndex = BUFFER;
+	}
+
+	/** Advances all streams and returns one 32-bit value of each */
+	inline void next(uint32_t r[4]) {
+		for (int j = 0; j < 4; j++) {
+			r[j] = s[0][j] + s[3][j];
+			uint32_t t = s[1][j] << 9;
+			s[2][j] ^= s[0][j];
+			s[3][j] ^= s[1][j];
+			s[1][j] ^= s[2][j];
+			s[0][j] ^= s[3][j];
+			s[2][j] ^= t;
+			s[3][j] = (s[3][j] << 11) | (s[3][j] >> 21);
+		}
+	}
+
+	/** Returns four uniform values in [0, 1) */
+	inline simd::float_4 uniform4() {
+		uint32_t r[4];
+		next(r);
+		// The lowest bits of xoshiro128+ are weak, the upper 24 bits fill the mantissa
+		return simd::float_4(r[0] >> 8, r[1] >> 8, r[2] >> 8, r[3] >> 8) * (1.f / 16777216.f);
+	}
+
+	/** Returns four normally distributed values with mean 0 and standard deviation 1 */
+	inline simd::float_4 normal4() {
+		// Box-Muller transform, 1 - uniform is in (0, 1]
+		simd::float_4 u1 = 1.f - uniform4();
+		simd::float_4 u2 = uniform4();
+		simd::float_4 r = simd::sqrt(-2.f * simd::log(u1));
+		simd::float_4 z0 = r * simd::cos(2.f * float(M_PI) * u2);
+		simd::float_4 z1 = r * simd::sin(2.f * float(M_PI) * u2);
+		z0.store(&normalBuffer[0]);
+		z1.store(&normalBuffer[4]);
+		normalIndex = 4;
+		return z0;
+	}
+
+	/** Returns a uniform value in [0, 1) */
+	inline float uniform() {
+		if (uniformIndex >= BUFFER) {
+			uniform4().store(&uniformBuffer[0]);
+			uniform4().store(&uniformBuffer[4]);
+			uniformIndex = 0;
+		}
+		return uniformBuffer[uniformIndex++];
+	}
+
+	/** Returns a normally distributed value with mean 0 and standard deviation 1 */
+	inline float normal() {
+		if (normalIndex >= BUFFER) {
+			normal4();
+			normalIndex = 0;
+		}
+		return normalBuffer[normalIndex++];
+	}
+
+	/** Returns an integer in [0, n) */
+	inline int uniformInt(int n) {
+		return std::min(int(uniform() * n), n - 1);
+	}
+
+	/**
+	 * Returns the number of failures before the first success of trials with probability `p`.
+	 * At the edges of (0, 1) the result is fixed: 0 for `p` >= 1 and 1 for `p` <= 0.
+	 */
+	inline int geometric(float p) {
+		if (!(p > 0.f)) return 1;
+		if (p >= 1.f) return 0;
+		float u = 1.f - uniform();
+		// Bounded for tiny `p`, where the quotient could exceed the range of int
+		return int(std::min(std::log(u) / std::log1p(-p), 1e6f));
+	}
+
+	json_t* toJson() {
+		json_t* rootJ = json_object();
+		// Stored as string as JSON integers are signed
+		json_object_set_new(rootJ, "seed", json_string(string::f("%016llx", (unsigned long long)seed).c_str()));
+		json_object_set_new(rootJ, "reproducible", json_boolean(reproducible));
+		return rootJ;
+	}
+
+	void fromJson(json_t* rootJ) {
+		reproducible = json_boolean_value(json_object_get(rootJ, "reproducible"));
+		json_t* seedJ = json_object_get(rootJ, "seed");
+		if (!reproducible || !json_is_string(seedJ)) return;
+		setSeed(std::strtoull(json_string_value(seedJ), NULL, 16));
+	}
+};
+
+
+/** Submenu for restarting the random sequence of `module->prng`, drawing a new seed or storing it in the patch */
+template <class MODULE>
+struct PrngSeedMenuItem : MenuItem {
+	MODULE* module;
+
+	PrngSeedMenuItem() {
+		rightText = RIGHT_ARROW;
+	}
+
+	Menu* createChildMenu() override {
+		struct RestartItem : MenuItem {
+			MODULE* module;
+			void onAction(const event::Action& e) override {
+				module->prng.setSeed(module->prng.seed);
+			}
+		};
+
+		struct NewSeedItem : MenuItem {
+			MODULE* module;
+			void onAction(const event::Action& e) override {
+				module->prng.setSeed(random::u64());
+			}
+		};
+
+		struct ReproducibleItem : MenuItem {
+			MODULE* module;
+			void onAction(const event::Action& e) override {
+				module->prng.reproducible ^= true;
+			}
+			void step() override {
+				rightText = module->prng.reproducible ? "✔" : "";
+				MenuItem::step();
+			}
+		};
+
+		Menu* menu = new Menu;
+		menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Seed %016llx", (unsigned long long)module->prng.seed)));
+		menu->addChild(construct<RestartItem>(&MenuItem::text, "Restart sequence", &RestartItem::module, module));
+		menu->addChild(construct<NewSeedItem>(&MenuItem::text, "New seed", &NewSeedItem::module, module));
+		menu->addChild(new MenuSeparator());
+		menu->addChild(construct<ReproducibleItem>(&MenuItem::text, "Reproducible (store seed in patch)", &ReproducibleItem::module, module));
+		return menu;
+	}
+};
@@ -0,0 +1,166 @@
+#include "profiler.hpp"
+#include <mutex>
+#include <osdialog.h>
+
+
+namespace Profiler {
+
+std::atomic<bool> enabled{false};
+
+static std::mutex mutex;
+static std::vector<std::pair<Module*, Stats*>> instances;
+
+/** Reference points for converting ticks into nanoseconds, taken when profiling is enabled */
+static uint64_t calibrationTicks = 0;
+static std::chrono::steady_clock::time_point calibrationTime;
+
+static const char CSV_FILTERS[] = "CSV (.csv):csv";
+
+void add(Module* module, Stats* stats) {
+	std::lock_guard<std::mutex> lock(mutex);
+	instances.push_back(std::make_pair(module, stats));
+}
+
+void remove(Module* module) {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto it = instances.begin(); it != instances.end(); it++) {
+		if (it->first == module) {
+			instances.erase(it);
+			return;
+		}
+	}
+}
+
+static void setEnabled(bool e) {
+	if (e && !enabled) {
+		calibrationTicks = ticks();
+		calibrationTime = std::chrono::steady_clock::now();
+		// Windows interrupted by the last disable must not be mixed into the new figures
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& i : instances) {
+			i.second->requestReset();
+		}
+	}
+	enabled = e;
+}
+
+static float nsPerTick() {
+	uint64_t t = ticks() - calibrationTicks;
+	int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - calibrationTime).count();
+	if (t == 0 || ns <= 0) return 0.f;
+	return float(double(ns) / double(t));
+}
+
+/** Share of one sample period spent in process() on average, in percent */
+static float load(Stats* stats, float k) {
+	float sampleRate = stats->sampleRate;
+	if (sampleRate == 0.f) return 0.f;
+	return stats->meanTicks * k * sampleRate * 1e-7f;
+}
+
+static Stats* find(Module* module) {
+	for (auto& i : instances) {
+		if (i.first == module) return i.second;
+	}
+	return NULL;
+}
+
+static void exportCsv(std::string path) {
+	FILE* file = std::fopen(path.c_str(), "w");
+	if (!file) return;
+	DEFER({
+		std::fclose(file);
+	});
+
+	float k = nsPerTick();
+	std::fprintf(file, "module,id,mean_ns,p99_ns,max_ns,load_percent\n");
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto& i : instances) {
+		Stats* s = i.second;
+		std::fprintf(file, "%s,%i,%.1f,%.1f,%.1f,%.4f\n",
+			i.first->model ? i.first->model->slug.c_str() : "",
+			i.first->id,
+			s->meanTicks * k,
+			s->p99Ticks * k,
+			s->maxTicks * k,
+			load(s, k));
+	}
+}
+
+static void exportCsvDialog() {
+	osdialog_filters* filters = osdialog_filters_parse(CSV_FILTERS);
+	DEFER({
+		osdialog_filters_free(filters);
+	});
+
+	std::string dir = asset::user("");
+	char* path = osdialog_file(OSDIALOG_SAVE, dir.c_str(), "profile.csv", filters);
+	if (!path) {
+		// No path selected
+		return;
+	}
+	DEFER({
+		free(path);
+	});
+
+	std::string pathStr = path;
+	if (string::filenameExtension(string::filename(pathStr)).empty()) {
+		pathStr += ".csv";
+	}
+	exportCsv(pathStr);
+}
+
+
+struct ProfilingMenuItem : MenuItem {
+	Module* module;
+
+	ProfilingMenuItem() {
+		rightText = RIGHT_ARROW;
+	}
+
+	Menu* createChildMenu() override {
+		struct EnabledItem : MenuItem {
+			void onAction(const event::Action& e) override {
+				setEnabled(!enabled);
+			}
+			void step() override {
+				rightText = enabled ? "✔" : "";
+				MenuItem::step();
+			}
+		};
+
+		struct ExportItem : MenuItem {
+			void onAction(const event::Action& e) override {
+				exportCsvDialog();
+			}
+		};
+
+		Menu* menu = new Menu;
+		menu->addChild(construct<EnabledItem>(&MenuItem::text, "Enabled (all modules)"));
+
+		if (enabled) {
+			std::lock_guard<std::mutex> lock(mutex);
+			Stats* s = find(module);
+			if (s) {
+				float k = nsPerTick();
+				menu->addChild(new MenuSeparator());
+				menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Mean %.0f ns", s->meanTicks * k)));
+				menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("p99 %.0f ns", s->p99Ticks * k)));
+				menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Max %.0f ns", s->maxTicks * k)));
+				menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Load %.3f %%", load(s, k))));
+			}
+		}
+
+		menu->addChild(new MenuSeparator());
+		menu->addChild(construct<ExportItem>(&MenuItem::text, "Export all as CSV..."));
+		return menu;
+	}
+};
+
+void appendContextMenu(Menu* menu, Module* module) {
+	if (!module) return;
+	menu->addChild(new MenuSeparator());
+	menu->addChild(construct<ProfilingMenuItem>(&MenuItem::text, "Profiling", &ProfilingMenuItem::module, module));
+}
+
+} // namespace Profiler
@@ -0,0 +1,148 @@
+#pragma once
+#include "rack.hpp"
+#include <atomic>
+#include <chrono>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+using namespace rack;
+
+
+/**
+ * Opt-in timing of process() for every module instance of the plugin. All models are
+ * registered through createModelProfiled, which wraps the module's process() with a cycle
+ * counter and adds a "Profiling" submenu to its context menu. When profiling is disabled the
+ * overhead is a single relaxed load per sample.
+ */
+namespace Profiler {
+
+/** Profiling of all instances, disabled by default */
+extern std::atomic<bool> enabled;
+
+inline uint64_t ticks() {
+#if defined(__i386__) || defined(__x86_64__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct Stats {
+	/** Histogram of process() times with four bins per octave */
+	static const int BINS = 4 * 32;
+
+	uint32_t hist[BINS] = {};
+	uint64_t sum = 0;
+	uint32_t count = 0;
+	uint32_t max = 0;
+
+	/** Figures of the last completed window in ticks, written by the engine thread */
+	std::atomic<float> meanTicks{0.f};
+	std::atomic<float> p99Ticks{0.f};
+	std::atomic<float> maxTicks{0.f};
+	std::atomic<float> sampleRate{0.f};
+	/** Set when profiling gets enabled, the engine thread starts a new window before counting */
+	std::atomic<bool> resetPending{false};
+
+	/** Discards the published figures of a previous profiling run, called before enabling */
+	void requestReset() {
+		meanTicks = 0.f;
+		p99Ticks = 0.f;
+		maxTicks = 0.f;
+		sampleRate = 0.f;
+		resetPending = true;
+	}
+
+	void clear() {
+		std::fill(hist, hist + BINS, 0);
+		sum = 0;
+		count = 0;
+		max = 0;
+	}
+
+	static int bin(uint32_t t) {
+		if (t < 4) return t;
+		int octave = 31 - __builtin_clz(t);
+		return octave * 4 + ((t >> (octave - 2)) & 3);
+	}
+
+	/** Lower bound of the ticks counted in bin `b` */
+	static float binValue(int b) {
+		if (b < 8) return std::min(b, 4);
+		int octave = b / 4;
+		return float(uint64_t(4 + (b & 3)) << (octave - 2));
+	}
+
+	inline void process(uint32_t t, float sampleRate) {
+		if (resetPending.load(std::memory_order_relaxed)) {
+			clear();
+			resetPending = false;
+		}
+		hist[bin(t)]++;
+		sum += t;
+		if (t > max) max = t;
+		// Windows of one second
+		if (++count >= sampleRate) publish(sampleRate);
+	}
+
+	void publish(float sampleRate) {
+		uint32_t p = count - count / 100;
+		uint32_t n = 0;
+		int b = 0;
+		for (; b < BINS - 1; b++) {
+			n += hist[b];
+			if (n >= p) break;
+		}
+		meanTicks = float(sum) / count;
+		p99Ticks = binValue(std::min(b + 1, BINS - 1));
+		maxTicks = max;
+		this->sampleRate = sampleRate;
+		clear();
+	}
+};
+
+void add(Module* module, Stats* stats);
+void remove(Module* module);
+void appendContextMenu(Menu* menu, Module* module);
+
+template <class TModule>
+struct ProfiledModule : TModule {
+	Stats stats;
+
+	ProfiledModule() {
+		Profiler::add(this, &stats);
+	}
+
+	~ProfiledModule() {
+		Profiler::remove(this);
+	}
+
+	void process(const Module::ProcessArgs& args) override {
+		if (!enabled.load(std::memory_order_relaxed)) {
+			TModule::process(args);
+			return;
+		}
+		uint64_t t0 = ticks();
+		TModule::process(args);
+		stats.process(uint32_t(ticks() - t0), args.sampleRate);
+	}
+};
+
+template <class TModule, class TModuleWidget>
+struct ProfiledWidget : TModuleWidget {
+	ProfiledWidget(TModule* module) : TModuleWidget(module) { }
+
+	void appendContextMenu(Menu* menu) override {
+		TModuleWidget::appendContextMenu(menu);
+		Profiler::appendContextMenu(menu, ModuleWidget::module);
+	}
+};
+
+} // namespace Profiler
+
+
+template <class TModule, class TModuleWidget>
+Model* createModelProfiled(const std::string& slug) {
+	return createModel<Profiler::ProfiledModule<TModule>, Profiler::ProfiledWidget<TModule, TModuleWidget>>(slug);
+}